@@ -0,0 +1,214 @@
+#include "block_io.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the raw system calls, as there's no need for all of liburing
+static int io_uring_setup(unsigned entries, io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0);
+}
+#endif
+
+bool BlockIO::open(unsigned depth)
+{
+	close();
+#ifdef HAVE_IO_URING
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	const int fd = io_uring_setup(depth, &p);
+	if (fd == -1)
+		return false;
+	
+	ring = fd;
+	entries = p.sq_entries;
+	
+	sqMapSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cqMapSize = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+	
+	sqMap = mmap(nullptr, sqMapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sqMap == MAP_FAILED)
+	{
+		sqMap = nullptr;
+		close();
+		return false;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cqMap = sqMap;
+	else
+	{
+		cqMap = mmap(nullptr, cqMapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cqMap == MAP_FAILED)
+		{
+			cqMap = nullptr;
+			close();
+			return false;
+		}
+	}
+	
+	sqesSize = p.sq_entries*sizeof(io_uring_sqe);
+	void *const s = mmap(nullptr, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (s == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	sqes = static_cast<io_uring_sqe*>(s);
+	
+	char *const sq = static_cast<char*>(sqMap);
+	sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	
+	char *const cq = static_cast<char*>(cqMap);
+	cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	return true;
+#else
+	(void)depth;
+	return false;
+#endif
+}
+
+void BlockIO::close()
+{
+#ifdef HAVE_IO_URING
+	if (sqes)
+		munmap(sqes, sqesSize);
+	if (cqMap && cqMap != sqMap)
+		munmap(cqMap, cqMapSize);
+	if (sqMap)
+		munmap(sqMap, sqMapSize);
+#endif
+	sqes = nullptr;
+	sqMap = cqMap = nullptr;
+	if (ring != -1)
+		::close(ring);
+	ring = -1;
+}
+
+bool BlockIO::runRing(size_t first, size_t count)
+{
+#ifdef HAVE_IO_URING
+	unsigned tail = *sqTail;
+	for (size_t i = first; i < first+count; i++)
+	{
+		const unsigned index = tail & *sqMask;
+		io_uring_sqe &sqe = sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = pending[i].fd;
+		sqe.addr = reinterpret_cast<std::uint64_t>(pending[i].buffer);
+		sqe.len = pending[i].length;
+		sqe.off = pending[i].offset;
+		sqe.user_data = i;
+		sqArray[index] = index;
+		tail++;
+	}
+	__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+	
+	size_t submitted = 0, completed = 0;
+	while (completed < count)
+	{
+		const int r = io_uring_enter(ring, count-submitted, 1, IORING_ENTER_GETEVENTS);
+		if (r == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			if (submitted == 0 && completed == 0)
+			{
+				// nothing went in: take them back, and do them without the ring
+				__atomic_store_n(sqTail, tail - unsigned(count), __ATOMIC_RELEASE);
+				return false;
+			}
+			throw std::runtime_error("io_uring_enter failed: " + std::to_string(errno));
+		}
+		submitted += r;
+		
+		unsigned head = *cqHead;
+		while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe &cqe = cqes[head & *cqMask];
+			results[cqe.user_data] = cqe.res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+	return true;
+#else
+	(void)first;
+	(void)count;
+	return false;
+#endif
+}
+
+const std::vector<ssize_t>& BlockIO::run()
+{
+	static const unsigned metric = Stats::metric("io batch of reads");
+	const Stats::Timer timer(metric);
+	results.assign(pending.size(), 0);
+	
+	size_t done = 0;
+	if (ring != -1)
+	{
+		while (done < pending.size())
+		{
+			const size_t count = std::min<size_t>(entries, pending.size()-done);
+			if (!runRing(done, count))
+				break;
+			done += count;
+		}
+	}
+	
+	for (size_t i = done; i < pending.size(); i++)
+	{
+		const request &r = pending[i];
+		const ssize_t n = pread(r.fd, r.buffer, r.length, r.offset);
+		results[i] = n == -1 ? -errno : n;
+	}
+	
+	// a read that came up short wasn't necessarily at the end of the file
+	for (size_t i = 0; i < done; i++)
+	{
+		const request &r = pending[i];
+		while (results[i] > 0 && size_t(results[i]) < r.length)
+		{
+			const ssize_t n = pread(r.fd, static_cast<char*>(r.buffer)+results[i],
+				r.length-results[i], r.offset+results[i]);
+			if (n <= 0)
+				break;
+			results[i] += n;
+		}
+	}
+	
+	pending.clear();
+	return results;
+}
@@ -0,0 +1,65 @@
+#ifndef BLOCK_IO_H
+#define BLOCK_IO_H
+
+#include <sys/types.h>
+#include <vector>
+#include <cstddef>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// A batch of reads that are all issued before any of them is waited for.
+// With io_uring, they're submitted to the kernel together; otherwise
+// (an old kernel, one that has it disabled, or --no-io-uring), they're
+// simply done one after another with pread.
+class BlockIO
+{
+	struct request
+	{
+		int fd;
+		void *buffer;
+		size_t length;
+		off_t offset;
+	};
+	std::vector<request> pending;
+	std::vector<ssize_t> results;
+	
+	int ring=-1;
+	unsigned entries=0;
+	void *sqMap=nullptr, *cqMap=nullptr;
+	size_t sqMapSize=0, cqMapSize=0;
+	io_uring_sqe *sqes=nullptr;
+	size_t sqesSize=0;
+	unsigned *sqHead=nullptr, *sqTail=nullptr, *sqMask=nullptr, *sqArray=nullptr;
+	unsigned *cqHead=nullptr, *cqTail=nullptr, *cqMask=nullptr;
+	io_uring_cqe *cqes=nullptr;
+	
+	void close();
+	// submit pending[first, first+count) and wait for all of them
+	bool runRing(size_t first, size_t count);
+
+public:
+	~BlockIO() { close(); }
+	
+	// use an io_uring of 'depth' entries, if possible
+	bool open(unsigned depth);
+	bool usingRing() const { return ring != -1; }
+	
+	// read 'length' bytes at 'offset' of 'fd' into 'buffer', when run() is
+	void read(int fd, void *buffer, size_t length, off_t offset)
+	{
+		request r;
+		r.fd = fd;
+		r.buffer = buffer;
+		r.length = length;
+		r.offset = offset;
+		pending.push_back(r);
+	}
+	size_t queued() const { return pending.size(); }
+	
+	// do what's been queued; what each one returned (or -errno), in the
+	// order they were queued
+	const std::vector<ssize_t>& run();
+};
+
+#endif
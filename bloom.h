@@ -0,0 +1,78 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An approximate set of keys: it can wrongly say it contains a key (about
+// 1% of the time while it's not full), but never wrongly say it doesn't.
+// Nothing can be removed, so whoever keeps one rebuilds it from scratch
+// when it fills up.
+class Bloom
+{
+	std::vector<std::uint64_t> bits;
+	size_t capacity=0;
+	size_t count=0;
+	
+	static const unsigned hashes = 7;
+	static const unsigned bitsPerKey = 10;
+	
+	static std::uint64_t mix(std::uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+public:
+	static std::uint64_t key(std::uint64_t a, const std::string &b)
+	{
+		return mix(a) ^ std::hash<std::string>()(b);
+	}
+	
+	// forget everything, and make room for 'keys' keys
+	void reset(size_t keys)
+	{
+		capacity = std::max<size_t>(keys, 4096);
+		bits.assign((capacity*bitsPerKey+63)/64, 0);
+		count = 0;
+	}
+	
+	void add(std::uint64_t key)
+	{
+		if (bits.empty())
+			return;
+		const std::uint64_t h1 = mix(key), h2 = mix(h1) | 1;
+		const std::uint64_t n = bits.size()*64;
+		for (unsigned i=0; i < hashes; i++)
+		{
+			const std::uint64_t b = (h1 + i*h2) % n;
+			bits[b/64] |= std::uint64_t(1) << (b%64);
+		}
+		count++;
+	}
+	
+	// false if 'key' was certainly never added; always true before reset()
+	bool contains(std::uint64_t key) const
+	{
+		if (bits.empty())
+			return true;
+		const std::uint64_t h1 = mix(key), h2 = mix(h1) | 1;
+		const std::uint64_t n = bits.size()*64;
+		for (unsigned i=0; i < hashes; i++)
+		{
+			const std::uint64_t b = (h1 + i*h2) % n;
+			if (!(bits[b/64] & (std::uint64_t(1) << (b%64))))
+				return false;
+		}
+		return true;
+	}
+	
+	// more has been added than it was made for, so it's less accurate
+	bool full() const { return count > capacity; }
+};
+
+#endif
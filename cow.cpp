@@ -6,22 +6,52 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <dirent.h>
 #include <unistd.h>
 
+#include <cstddef>
 #include <cstring>
 #include <iostream>
 #include <array>
+#include <chrono>
 #include <map>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <set>
+#include <sstream>
+#include <iomanip>
 
 #include "sql.h"
+#include "nodes.h"
+#include "bloom.h"
+#include "history_index.h"
+#include "block_io.h"
+#include "snapshots.h"
+#include "stats.h"
 
 std::string origin_path;
 int origin_fd=-1;
 
 Sql db;
+Nodes nodes(db);
+Snapshots snapshots(db, nodes);
+
+// whether the backing filesystem can clone extents, in which case
+// preserved blocks are cloned into .cow/clones instead of copied
+bool reflink_capture=false;
 
 extern void register_openat_vfs();
 
@@ -87,6 +117,7 @@ static std::vector<unsigned char> serialize_stat(struct stat &st)
 static struct stat deserialize_stat(const std::vector<unsigned char> &x)
 {
 	struct stat st;
+	std::memset(&st, 0, sizeof(st));
 	st.st_mode = get_int(x, 0);
 	st.st_nlink = get_int(x, 1);
 	st.st_uid = get_int(x, 2);
@@ -122,7 +153,10 @@ public:
 	{
 		if (!done)
 		{
+			// which leaves it open, and with it the transaction it began
 			db.exec("rollback to sp");
+			db.exec("release sp");
+			nodes.forget();
 			done=true;
 		}
 	}
@@ -156,367 +190,2622 @@ static bool is_dotcow(const char *path)
 	return false;
 }
 
-struct cow_file_info
+// all that can be seen of /.cow: reports, as of when they're opened
+typedef std::string (*dotcow_report)();
+static std::string amplification_report();
+static const std::pair<const char*, dotcow_report> dotCowReports[] =
 {
-	int fd=-1;
-	bool is_original=false;
-	
-	// never true on "original"-path opens:
-	bool is_new; // as opposed to historical
-	bool is_historical=false; // as opposed to new
-	bool removed=false; // as opposed to still existing
-	bool is_directory=false; // this path is a directory name
-	
-	std::string oldpath; // the path of this file in the historic tree (before mv)
-	std::string newpath; // the path of this file in the working tree (after mv)
-	
-	// if not new, the command, if any
-	std::string command;
-	std::vector<unsigned char> commanddata;
-	
-	ssize_t original_file_size=-1;
-	
-	cow_file_info(const char *path);
-	
-	~cow_file_info()
+	std::make_pair("stats", &Stats::report), // what's been timed (see stats.h)
+	std::make_pair("amplification", &amplification_report),
+};
+
+// the report at 'path', if it's one
+static dotcow_report report_of(const char *path)
+{
+	if (!is_dotcow(path) || path[sizeof(dotCow)-1] != '/')
+		return nullptr;
+	for (const auto &report : dotCowReports)
+		if (std::strcmp(path+sizeof(dotCow), report.first) == 0)
+			return report.second;
+	return nullptr;
+}
+
+// named snapshots, which are only ever read from (see snapshots.h)
+static const char dotSnapshots[] = "/.snapshots";
+static bool is_snapshots(const char *path)
+{
+	if (memcmp(path, dotSnapshots, sizeof(dotSnapshots)-1)==0)
 	{
-		if (fd != -1)
-			::close(fd);
+		const char back = path[sizeof(dotSnapshots)-1];
+		if (back == '\0')
+			return true;
+		if (back == '/')
+			return true;
 	}
+	return false;
+}
+
+// historical_filedata has a row for each block of the original file that
+// was preserved. A row's data is either the block's bytes, or an integer
+// for a run that may span many blocks: a positive one is the length of a
+// run of zeroes (holes or blocks that were all zeroes) starting at that
+// offset, a negative one is the (negated) length of a run that was cloned
+// into the file's clone file in .cow/clones, at the same offset.
+// Either way, an extent shorter than a whole number of blocks marks the
+// end of the original file.
+static const char extentLength[]
+	= "(case when typeof(data)='integer' then abs(data) else length(data) end)";
+
+struct historical_extent
+{
+	uint64_t offset=0;
+	uint64_t length=0;
+	bool zeroes=false;
+	bool cloned=false;
+	std::string data; // empty if zeroes or cloned
 	
-	
-	Sql& filedata()
+	bool covers(uint64_t block) const
 	{
-		if (!file_database.isOpen())
-		{
-			throw std::runtime_error("tried to get filedata on directory");
-		}
-		return file_database;
+		return block == offset || (block > offset && block < offset+length);
 	}
-	
-	std::vector<bool> historical_blocks_present;
-	
-	static std::unique_ptr<cow_file_info> make(const char *path)
+	// the original file ends within (or right at the start of) this extent
+	bool eof() const
 	{
-		return std::unique_ptr<cow_file_info>(new cow_file_info(path));
+		return length == 0 || length%4096 != 0;
 	}
-private:
-	Sql file_database;
 };
 
-cow_file_info::cow_file_info(const char *path)
+// Recently read blocks of /.original files, so reading them again doesn't
+// query (and decode) historical_filedata. What's kept for a block is what
+// find_extent said about it, including that nothing of it was preserved,
+// so whatever preserves blocks has to invalidate() them. It's split into
+// shards, each with its own lock and least recently used list, and holds
+// about 'capacity' bytes in all.
+class historical_block_cache
 {
-	if (::is_original(path))
+public:
+	struct block
 	{
-		is_original = true;
-		is_new = false;
-		
-		if (strcmp(path, dotOriginal)==0)
-			path = "/";
-		else
-			path = path+sizeof(dotOriginal)-1;
-	}
+		bool found=false;
+		historical_extent extent;
+	};
 	
-	typedef Args<std::string,std::vector<unsigned char>> TwoStrings;
+private:
+	typedef std::pair<node_id, uint64_t> key;
+	typedef std::list<std::pair<key, std::shared_ptr<const block>>> lru_list;
+	
+	static const unsigned shardCount = 16;
+	struct shard
+	{
+		std::mutex lock;
+		lru_list lru; // most recently used first
+		std::map<key, lru_list::iterator> blocks;
+		size_t bytes=0;
+	};
+	shard shards[shardCount];
+	size_t capacityPerShard=0;
 	
-	newpath = path;
-	is_historical = false;
+	std::atomic<uint64_t> hitCount{0}, missCount{0};
+	std::atomic<uint64_t> invalidations{0};
 	
+	shard& shardOf(node_id node, uint64_t offset)
 	{
-		for (size_t i=1; i < newpath.size(); i++)
-		{
-			if (newpath[i]=='/')
-			{
-				std::string upto = newpath.substr(0, i-1);
-				::mkdirat(origin_fd, atdir(upto.c_str()), 0700);
-			}
-		}
+		return shards[(uint64_t(node)*0x9e3779b1 + offset/4096) % shardCount];
+	}
+	static size_t cost(const block &b)
+	{
+		return sizeof(block) + b.extent.data.size() + 64;
 	}
 	
-	db.statement("select command,data from historical_files where path=?")
-		.arg(path)
-		.exec(TwoStrings(), [&] (const TwoStrings::tuple &args)
-		{
-			command= std::get<0>(args);
-			commanddata = std::get<1>(args);
-			
-			is_historical = true;
-			
-			if (command == "rename")
-			{
-				newpath = binary_to_string(commanddata);
-			}
-			else if (command == "erased")
-			{
-				newpath = "";
-				removed = true;
-			}
-		});
-	
+public:
+	void setCapacity(size_t capacity) { capacityPerShard = capacity/shardCount; }
 	
-	if (!is_original)
+	// null if it's not here
+	std::shared_ptr<const block> get(node_id node, uint64_t offset)
 	{
-		unsigned count = db.statement("select count(*) from new_files where path=?")
-			.arg(newpath).execValue<unsigned>();
-		is_new = (count > 0);
-		newpath = path;
+		shard &s = shardOf(node, offset);
+		std::lock_guard<std::mutex> l(s.lock);
+		const auto i = s.blocks.find(key(node, offset));
+		if (i == s.blocks.end())
+		{
+			missCount++;
+			return nullptr;
+		}
+		hitCount++;
+		s.lru.splice(s.lru.begin(), s.lru, i->second);
+		return i->second->second;
 	}
 	
-	if (!is_new)
-		is_historical = true; // later on, we might set this to false
-
-	try
+	// changes whenever something is invalidated
+	uint64_t epoch() const { return invalidations; }
+	
+	void put(node_id node, uint64_t offset, const std::shared_ptr<const block> &b)
 	{
-		oldpath = 
-			db.statement("select path from historical_files where data=? and command='rename'")
-			.arg(path)
-			.execValue<std::string>();
-		is_historical = false;
+		put(node, offset, b, epoch());
 	}
-	catch (no_rows&)
+	// only if nothing was invalidated since 'since', which is when 'b'
+	// was looked up
+	void put(node_id node, uint64_t offset, const std::shared_ptr<const block> &b, uint64_t since)
 	{
-		oldpath = path;
+		if (capacityPerShard == 0)
+			return;
+		shard &s = shardOf(node, offset);
+		std::lock_guard<std::mutex> l(s.lock);
+		if (since != invalidations || s.blocks.count(key(node, offset)))
+			return;
+		s.lru.push_front(std::make_pair(key(node, offset), b));
+		s.blocks[key(node, offset)] = s.lru.begin();
+		s.bytes += cost(*b);
+		while (s.bytes > capacityPerShard && !s.lru.empty())
+		{
+			s.bytes -= cost(*s.lru.back().second);
+			s.blocks.erase(s.lru.back().first);
+			s.lru.pop_back();
+		}
 	}
 	
-	if (!is_new)
+	// blocks of 'node' from 'begin' up to 'end' have been preserved
+	void invalidate(node_id node, uint64_t begin, uint64_t end)
 	{
-		// if the file is not new, then its size is:
-		//   if the historical_filedata has a blocksize < 4096, then that is the last block
-		//   otherwise, it's the length of the true file
-		
-		if (!newpath.empty())
+		invalidations++;
+		for (shard &s : shards)
 		{
-			// if I don't know the end of the file from the historical_filedata,
-			// then it must be in the working dir
-			struct stat stbuf;
-			int res = ::fstatat( origin_fd, atdir(newpath.c_str()), &stbuf, 0);
-			if (res != -1)
-			{
-				original_file_size = stbuf.st_size;
-				is_directory = S_ISDIR(stbuf.st_mode);
-			}
-			else
+			std::lock_guard<std::mutex> l(s.lock);
+			auto i = s.blocks.lower_bound(key(node, begin));
+			while (i != s.blocks.end() && i->first.first == node && i->first.second < end)
 			{
-				is_historical = false;
+				s.bytes -= cost(*i->second->second);
+				s.lru.erase(i->second);
+				i = s.blocks.erase(i);
 			}
 		}
-		
-		if (!is_directory)
-		{
-			file_database.open(std::string(dotCow+1) + "/filedata" + oldpath);
-			file_database.exec("pragma synchronous = NORMAL");
-			file_database.exec("create table if not exists historical_filedata (offset integer primary key, data)");
+	}
+	
+	uint64_t hits() const { return hitCount; }
+	uint64_t misses() const { return missCount; }
+};
 
-			try
-			{
-				original_file_size
-					= filedata().statement("select coalesce(offset+length(data),?) from historical_filedata where "
-							"offset=(select coalesce(max(offset),0) from historical_filedata) "
-							"and length(data)!=4096"
-						)
-						.arg(-1)
-						.execValue<uint64_t>();
-			}
-			catch (no_rows&) { }
-		
-			// now let's gather a list of blocks that are present
-			const uint64_t sz
-				= file_database.statement("select coalesce(max(offset),0) from historical_filedata")
-					.execValue<uint64_t>();
-			
-			historical_blocks_present.resize((sz / 4096)+1, false);
+static const size_t default_block_cache_size = 64*1024*1024;
+static historical_block_cache block_cache;
 
-			file_database.statement("select offset from historical_filedata")
-				.exec(Args<uint64_t>(), [this] (const std::tuple<uint64_t> &t) 
-				{
-					historical_blocks_present[std::get<0>(t)/4096]=true;
-				});
-		}
-	}
+static void mark_present(std::vector<bool> &historical_blocks_present, uint64_t offset, uint64_t length)
+{
+	const uint64_t last = length == 0 ? offset/4096 : (offset+length-1)/4096;
+	if (historical_blocks_present.size() <= last)
+		historical_blocks_present.resize(last+1, false);
+	for (uint64_t b = offset/4096; b <= last; b++)
+		historical_blocks_present[b] = true;
 }
 
-static int cow_getattr(const char *path, struct stat *stbuf)
+static bool is_present(const std::vector<bool> &historical_blocks_present, uint64_t block)
 {
-	memset(stbuf, 0, sizeof(struct stat));
-	if (is_dotcow(path))
-		return -ENOENT;
-	
-	if (is_original(path))
-	{
-		const std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
-		if (!info->is_historical)
-			return -ENOENT;
-		
-		if (info->is_new)
-			return -ENOENT;
-		
-		if (info->command == "rmdir" || info->command == "erased" || info->command == "erased_link")
-		{
-			*stbuf = deserialize_stat(info->commanddata);
-		}
-		else
+	return historical_blocks_present.size() > block/4096 && historical_blocks_present[block/4096];
+}
+
+// true if the buffer is all zeroes; glibc's memcmp is vectorized, so
+// comparing the buffer against itself shifted by a byte is about as fast
+// as hand-written SIMD
+static bool is_zero(const char *data, size_t len)
+{
+	if (len == 0)
+		return true;
+	return data[0] == 0 && std::memcmp(data, data+1, len-1) == 0;
+}
+
+static const char historyIndexPath[] = ".cow/history.idx";
+static HistoryIndex history_index;
+
+// the nodes that historical_files or new_files mention, so that a path
+// that was never touched can be told apart without querying either
+static Bloom recorded_nodes;
+
+static void load_recorded_nodes()
+{
+	recorded_nodes.reset(2*db.statement(
+			"select (select count(*) from historical_files) + (select count(*) from new_files)"
+		).execValue<std::uint64_t>());
+	db
+		.statement("select node from historical_files "
+			"union all select data from historical_files where command='rename' "
+			"union all select node from new_files")
+		.exec(Args<std::uint64_t>(), [] (const std::tuple<std::uint64_t> &node)
 		{
-			const int res = ::fstatat( origin_fd, atdir(info->newpath.c_str()), stbuf, 0);
-			if (res == -1)
-			{
-				std::cerr << "failed to fstat the file [origin]" << info->newpath << " which should be there" << std::endl;
-				return -1;
-			}
-			stbuf->st_size = info->original_file_size;
-		}
+			recorded_nodes.add(std::get<0>(node));
+		});
+}
+
+// 'node' is about to be mentioned in historical_files or new_files, or its
+// rows there are about to change
+static node_id record(node_id node)
+{
+	if (node == 0)
 		return 0;
-	}
-	else
-	{
-		int res = ::fstatat( origin_fd, atdir(path), stbuf, 0);
-		if (res==0)
-			return 0;
-		else
-			return -errno;
-	}
+	if (recorded_nodes.full())
+		load_recorded_nodes();
+	recorded_nodes.add(node);
+	history_index.changed(node);
+	return node;
 }
 
-static int cow_opendir(const char *path, struct fuse_file_info *fi)
+static bool maybe_recorded(node_id node)
 {
-	if (is_dotcow(path))
-		return -ENOENT;
-	if (is_original(path))
-	{
+	return node != 0 && recorded_nodes.contains(node);
+}
+
+// where 'node' was renamed to, or 0
+static node_id renamed_to(node_id node)
+{
+	if (!maybe_recorded(node))
 		return 0;
+	node_id to;
+	if (history_index.renamedTo(node, to))
+		return to;
+	try
+	{
+		return db.statement("select data from historical_files where node=? and command='rename'")
+			.arg(node)
+			.execValue<std::uint64_t>();
 	}
-	else
+	catch (no_rows&)
 	{
-		int dfd = ::openat(origin_fd, atdir(path), O_DIRECTORY);
-		if (dfd == -1)
-			return -errno;
-		
-		DIR *d = fdopendir(dfd);
-		if (!d)
-			return -errno;
-		
-		fi->fh = reinterpret_cast<uint64_t>(d);
 		return 0;
 	}
 }
 
-static int cow_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *fi)
+// what was renamed to 'node', or 0
+static node_id renamed_from(node_id node)
 {
-	if (is_dotcow(path))
-		return -ENOENT;
-	if (is_original(path))
-	{
-		if (strcmp(path, dotOriginal)==0)
-			path = "/";
-		else
-			path = path+sizeof(dotOriginal)-1;
-		// we search for files, they must either exist in historical_files, or in the current
-		// directory and not in new_files
-		
-		std::set<std::string> deletedPaths, newPaths;
-		std::map<std::string, std::string> renamedPaths;
-		
-		std::string backIsMore= path;
-		backIsMore.back()++;
-		db
-			.statement("select path from historical_files where path >=? and path <? and (command='erased' or command='rmdir')")
-			.arg(path)
-			.arg(backIsMore)
-			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &tpath)
-			{
-				const std::string &path = std::get<0>(tpath);
-				std::string opath = path.substr(path.rfind('/')+1);
-				deletedPaths.insert(opath);
-			});
-			
-		db
-			.statement("select path,data from historical_files where path >=? and path <? and (command='rename')")
-			.arg(path)
-			.arg(backIsMore)
-			.exec(Args<std::string,std::string>(), [&] (const std::tuple<std::string,std::string> &tpath)
-			{
-				const std::string &path = std::get<0>(tpath);
-				const std::string &newpath = std::get<1>(tpath);
-				std::string opath = path.substr(path.rfind('/')+1);
-				std::string onewpath = newpath.substr(newpath.rfind('/')+1);
-				renamedPaths[onewpath] = opath;
-			});
-			
-		db
-			.statement("select path from new_files where path >=? and path <?  and (command='created' or command='mkdir')")
-			.arg(path)
-			.arg(backIsMore)
-			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &tpath)
-			{
-				const std::string &path = std::get<0>(tpath);
-				std::string opath = path.substr(path.rfind('/')+1);
-				newPaths.insert(opath);
-			});
-		
-		const int dfd = ::openat(origin_fd, atdir(path), O_DIRECTORY);
-		if (dfd != -1)
-		{
-			
-			DIR *d = fdopendir(dfd);
-			if (d)
-			{
-				while (true)
-				{
-					dirent entry;
-					dirent *has;
-					readdir_r(d, &entry, &has);
-					if (!has)
-						break;
-					if (std::strcmp(entry.d_name, "/.cow") == 0)
-						continue;
-					if (renamedPaths.count(entry.d_name) >0)
-					{
-						filler(buf, renamedPaths[entry.d_name].c_str(), nullptr, 0);
-						renamedPaths.erase(entry.d_name);
-					}
-					else if (deletedPaths.count(entry.d_name)>0)
-					{
-						deletedPaths.erase(entry.d_name);
-						filler(buf, entry.d_name, nullptr, 0);
-					}
-					else if (!newPaths.count(entry.d_name)>0)
-						filler(buf, entry.d_name, nullptr, 0);
-				}
-				closedir(d);
-			}
-		}
-		for (const std::string &x : deletedPaths)
-			filler(buf, x.c_str(), nullptr, 0);
-		for (const std::pair<std::string,std::string> &x : renamedPaths)
-			filler(buf, x.second.c_str(), nullptr, 0);
+	if (!maybe_recorded(node))
 		return 0;
+	node_id from;
+	if (history_index.renamedFrom(node, from))
+		return from;
+	try
+	{
+		return db.statement("select node from historical_files where data=? and command='rename'")
+			.arg(node)
+			.execValue<std::uint64_t>();
 	}
-	else
+	catch (no_rows&)
 	{
-		DIR *d = reinterpret_cast<DIR*>(fi->fh);
-		
-		while (true)
-		{
-			dirent entry;
-			dirent *has;
-			readdir_r(d, &entry, &has);
-			if (!has)
-				break;
-			if (std::strcmp(entry.d_name, ".cow") == 0)
-				continue;
-			filler(buf, entry.d_name, nullptr, 0);
-		}
-		
 		return 0;
 	}
 }
 
-static int cow_releasedir(const char *path, struct fuse_file_info *fi)
+// A rename is recorded once, for what was renamed and not for anything in
+// it: its row maps the node of the original path to the node of where it
+// is in the working tree. Everything in a renamed directory is found by
+// way of the closest of its parents that has such a row.
+
+// where the original 'path' is in the working tree, if it's still there
+static std::string working_path(const std::string &path)
 {
-	if (is_original(path))
+	const std::vector<std::pair<node_id,size_t>> prefixes = nodes.prefixes(path);
+	for (auto i = prefixes.rbegin(); i != prefixes.rend(); ++i)
 	{
-	
+		const node_id to = renamed_to(i->first);
+		if (to)
+			return nodes.path(to) + path.substr(i->second);
 	}
-	else
+	return path;
+}
+
+// what 'path' in the working tree was in the original tree, if it was there
+static std::string original_path(const std::string &path)
+{
+	const std::vector<std::pair<node_id,size_t>> prefixes = nodes.prefixes(path);
+	for (auto i = prefixes.rbegin(); i != prefixes.rend(); ++i)
+	{
+		const node_id from = renamed_from(i->first);
+		if (from)
+			return nodes.path(from) + path.substr(i->second);
+	}
+	return path;
+}
+
+static bool is_new_path(const std::string &path)
+{
+	const node_id node = nodes.find(path);
+	if (!maybe_recorded(node))
+		return false;
+	bool isNew;
+	if (history_index.isNew(node, isNew))
+		return isNew;
+	return db.statement("select count(*) from new_files where node=?").arg(node).execValue<unsigned>() > 0;
+}
+
+// What's been preserved of a block, or of a run of blocks, on its way into
+// historical_filedata (see above for what 'run' means; when it's 0, it's
+// the block's bytes in 'data')
+struct capture
+{
+	uint64_t offset=0;
+	std::int64_t run=0;
+	std::vector<unsigned char> data;
+};
+
+// where what's already preserved at or before 'offset', by another handle
+// of the same file, stops covering it, or 'offset' if it doesn't
+static uint64_t preserved_to(Sql &filedata, uint64_t offset)
+{
+	uint64_t to = offset;
+	filedata.statement(std::string("select offset+") + extentLength + " from historical_filedata "
+		"where offset<=? order by offset desc limit 1")
+		.arg(offset)
+		.exec(Args<uint64_t>(), [&] (const std::tuple<uint64_t> &end)
+		{
+			to = std::max(to, std::get<0>(end));
+		});
+	return to;
+}
+
+static void preserve(Sql &filedata, const capture &c)
+{
+	if (c.run == 0)
+	{
+		if (preserved_to(filedata, c.offset) > c.offset)
+			return;
+		Sql::Statement s = filedata.statement("insert or ignore into historical_filedata values(?,?)");
+		s.arg(c.offset);
+		if (c.data.empty())
+			s.argBlob("");
+		else
+			s.argBlob(c.data);
+		s.exec();
+		return;
+	}
+	
+	// other handles of the file may have preserved blocks within the run
+	// since this one's was found, so only what's between them is recorded,
+	// each piece a run of its own
+	const int sign = c.run < 0 ? -1 : 1;
+	const uint64_t end = c.offset + sign*c.run;
+	std::vector<std::pair<uint64_t,uint64_t>> gaps;
+	uint64_t from = preserved_to(filedata, c.offset);
+	filedata.statement(std::string("select offset, offset+") + extentLength + " from historical_filedata "
+		"where offset>? and offset<? order by offset")
+		.arg(c.offset)
+		.arg(end)
+		.exec(Args<uint64_t,uint64_t>(), [&] (const std::tuple<uint64_t,uint64_t> &row)
+		{
+			if (std::get<0>(row) > from)
+				gaps.emplace_back(from, std::get<0>(row));
+			from = std::max(from, std::get<1>(row));
+		});
+	if (from < end)
+		gaps.emplace_back(from, end);
+	
+	for (const auto &gap : gaps)
+		filedata.statement("insert into historical_filedata values(?,?)")
+			.arg(gap.first)
+			.arg(std::int64_t(sign*std::int64_t(gap.second-gap.first)))
+			.exec();
+}
+
+// Writes don't wait for what they replace to get into the history: it's
+// staged here, and a thread of its own puts it into the files' databases,
+// many rows to a transaction. The working file is only written once what
+// it's replacing has been staged, and anything that needs a file's
+// history to be there (reading /.original, opening, fsync, release,
+// unmounting) waits for what's staged of that file first. Staging waits
+// while more than 'capacity' bytes are.
+//
+// So that a crash can't lose what's been staged, it's also appended to
+// the journal, which sync() puts on disk before the write that staged it
+// goes ahead. The journal is emptied whenever everything in it has been
+// written, and what's left in it at mount is written then by replay().
+class capture_writer
+{
+	struct staged
+	{
+		node_id node;
+		uint64_t sequence;
+		capture c;
+	};
+	
+	// what's in the journal for each capture, followed by the path and data
+	struct journal_record
+	{
+		std::uint32_t magic;
+		std::uint32_t checksum; // of everything after it
+		std::uint32_t pathLength;
+		std::uint32_t dataLength;
+		std::uint64_t offset;
+		std::int64_t run;
+	};
+	static const std::uint32_t journalMagic = 0x636f776a;
+	
+	static const size_t maxBatch = 1024;
+	static const size_t maxDatabases = 16;
+	
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake, written;
+	std::deque<staged> queue;
+	size_t bytes=0, capacity=0;
+	uint64_t sequence=0;
+	std::map<node_id, uint64_t> pending; // the last of each node's that's staged
+	std::set<node_id> failed;
+	bool stopping=false;
+	
+	int journal=-1;
+	uint64_t journalSize=0;
+	bool journalSynced=true;
+	bool keepJournal=false; // something in it couldn't be written
+	
+	std::map<node_id, std::unique_ptr<Sql>> databases;
+	
+	static size_t cost(const capture &c) { return sizeof(staged) + c.data.size(); }
+	static std::uint32_t checksum(const journal_record &r, const std::string &path, const std::vector<unsigned char> &data);
+	
+	void run();
+	// false if some of it couldn't be written
+	bool write(std::vector<staged> &batch);
+	bool write(node_id node, std::vector<staged>::iterator begin, std::vector<staged>::iterator end);
+	Sql& database(node_id node);
+	void append(const std::string &path, const capture &c);
+	
+public:
+	// 0 to have captures written before the write that makes them
+	void setCapacity(size_t c) { capacity = c; }
+	bool running() const { return thread.joinable(); }
+	
+	// write what a previous mount left in the journal
+	void replay();
+	
+	void start();
+	// once everything staged has been written
+	void stop();
+	
+	// 'c' was preserved of the file that was at 'path' (whose node is 'node')
+	void stage(node_id node, const std::string &path, capture &&c)
+	{
+		{
+			std::unique_lock<std::mutex> l(lock);
+			written.wait(l, [&] { return queue.empty() || bytes + cost(c) <= capacity; });
+			append(path, c);
+			staged s;
+			s.node = node;
+			s.sequence = ++sequence;
+			s.c = std::move(c);
+			bytes += cost(s.c);
+			pending[node] = s.sequence;
+			queue.push_back(std::move(s));
+		}
+		wake.notify_one();
+	}
+	
+	// put what's been staged so far on disk, in the journal
+	void sync()
+	{
+		if (!running() || journalSynced)
+			return;
+		if (::fdatasync(journal) == -1)
+			throw std::runtime_error("failed to sync the capture journal: " + std::to_string(errno));
+		journalSynced = true;
+	}
+	
+	// until what's staged of 'node' is in its database; false if some of
+	// it couldn't be put there
+	bool wait(node_id node)
+	{
+		if (node == 0 || !running())
+			return true;
+		std::unique_lock<std::mutex> l(lock);
+		written.wait(l, [&] { return !pending.count(node); });
+		return failed.erase(node) == 0;
+	}
+	
+	// whether nothing of 'node' is staged
+	bool idle(node_id node)
+	{
+		std::lock_guard<std::mutex> l(lock);
+		return !pending.count(node);
+	}
+};
+
+static const char captureJournalPath[] = ".cow/capture.journal";
+
+std::uint32_t capture_writer::checksum(const journal_record &r, const std::string &path, const std::vector<unsigned char> &data)
+{
+	// FNV-1a
+	std::uint32_t h = 2166136261u;
+	const auto add = [&h] (const void *p, size_t length)
+	{
+		const unsigned char *const b = static_cast<const unsigned char*>(p);
+		for (size_t i=0; i < length; i++)
+			h = (h ^ b[i]) * 16777619u;
+	};
+	add(&r.pathLength, sizeof(r) - offsetof(journal_record, pathLength));
+	add(path.data(), path.size());
+	add(data.data(), data.size());
+	return h;
+}
+
+void capture_writer::append(const std::string &path, const capture &c)
+{
+	journal_record r;
+	r.magic = journalMagic;
+	r.pathLength = path.size();
+	r.dataLength = c.data.size();
+	r.offset = c.offset;
+	r.run = c.run;
+	r.checksum = checksum(r, path, c.data);
+	
+	iovec parts[3];
+	parts[0].iov_base = &r;
+	parts[0].iov_len = sizeof(r);
+	parts[1].iov_base = const_cast<char*>(path.data());
+	parts[1].iov_len = path.size();
+	parts[2].iov_base = const_cast<unsigned char*>(c.data.data());
+	parts[2].iov_len = c.data.size();
+	const size_t length = sizeof(r) + path.size() + c.data.size();
+	
+	const ssize_t w = ::writev(journal, parts, 3);
+	if (w != ssize_t(length))
+	{
+		const int error = w == -1 ? errno : ENOSPC;
+		// don't leave half a record for the next one to follow
+		if (::ftruncate(journal, journalSize) == -1)
+			keepJournal = true;
+		throw std::runtime_error("failed to write the capture journal: " + std::to_string(error));
+	}
+	journalSize += length;
+	journalSynced = false;
+}
+
+void capture_writer::start()
+{
+	if (capacity == 0)
+		return;
+	journal = ::openat(origin_fd, captureJournalPath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+	if (journal == -1)
+	{
+		std::cerr << "error: failed to open " << captureJournalPath << ", "
+			"captures won't be staged: " << std::strerror(errno) << std::endl;
+		return;
+	}
+	struct stat st;
+	journalSize = ::fstat(journal, &st) == 0 ? st.st_size : 0;
+	thread = std::thread([this] { run(); });
+}
+
+void capture_writer::stop()
+{
+	if (!thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> l(lock);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+	databases.clear();
+	::close(journal);
+	journal = -1;
+	if (journalSize == 0 && !keepJournal)
+		::unlinkat(origin_fd, captureJournalPath, 0);
+}
+
+void capture_writer::replay()
+{
+	const int fd = ::openat(origin_fd, captureJournalPath, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return;
+	
+	// a record that isn't whole (or is garbage) is where the crash was
+	uint64_t count=0;
+	bool ok=true;
+	std::vector<staged> batch;
+	off_t at=0;
+	while (true)
+	{
+		journal_record r;
+		if (::pread(fd, &r, sizeof(r), at) != ssize_t(sizeof(r)) || r.magic != journalMagic
+			|| r.pathLength > PATH_MAX || r.dataLength > 4096)
+			break;
+		std::string path(r.pathLength, '\0');
+		staged s;
+		s.c.offset = r.offset;
+		s.c.run = r.run;
+		s.c.data.resize(r.dataLength);
+		if (::pread(fd, &path[0], path.size(), at+sizeof(r)) != ssize_t(path.size())
+			|| ::pread(fd, s.c.data.data(), s.c.data.size(), at+sizeof(r)+path.size()) != ssize_t(s.c.data.size())
+			|| checksum(r, path, s.c.data) != r.checksum)
+			break;
+		at += sizeof(r) + path.size() + s.c.data.size();
+		
+		s.node = nodes.intern(path);
+		s.sequence = ++count;
+		batch.push_back(std::move(s));
+		if (batch.size() == maxBatch)
+		{
+			ok = write(batch) && ok;
+			batch.clear();
+		}
+	}
+	ok = write(batch) && ok;
+	databases.clear();
+	::close(fd);
+	
+	if (count)
+		std::cerr << "replayed " << count << " captures from " << captureJournalPath << std::endl;
+	if (ok)
+		::unlinkat(origin_fd, captureJournalPath, 0);
+	else
+		std::cerr << "error: " << captureJournalPath << " is kept for the next mount" << std::endl;
+}
+
+void capture_writer::run()
+{
+	std::vector<staged> batch;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> l(lock);
+			wake.wait(l, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				break;
+			// what's in the batch still counts against capacity until it's written
+			while (!queue.empty() && batch.size() < maxBatch)
+			{
+				batch.push_back(std::move(queue.front()));
+				queue.pop_front();
+			}
+		}
+		
+		const bool ok = write(batch);
+		
+		{
+			std::lock_guard<std::mutex> l(lock);
+			for (const staged &s : batch)
+			{
+				bytes -= cost(s.c);
+				const auto p = pending.find(s.node);
+				if (p != pending.end() && p->second <= s.sequence)
+					pending.erase(p);
+			}
+			if (!ok)
+				keepJournal = true;
+			// everything that's in the journal is in the databases now
+			if (queue.empty() && !keepJournal && journalSize != 0)
+			{
+				if (::ftruncate(journal, 0) == 0)
+					journalSize = 0;
+			}
+		}
+		written.notify_all();
+		batch.clear();
+	}
+}
+
+bool capture_writer::write(std::vector<staged> &batch)
+{
+	// a transaction for each file, with its rows in the order they were staged
+	std::stable_sort(batch.begin(), batch.end(),
+		[] (const staged &a, const staged &b) { return a.node < b.node; });
+	bool ok = true;
+	for (auto i = batch.begin(); i != batch.end(); )
+	{
+		auto j = i;
+		while (j != batch.end() && j->node == i->node)
+			++j;
+		ok = write(i->node, i, j) && ok;
+		i = j;
+	}
+	return ok;
+}
+
+bool capture_writer::write(node_id node, std::vector<staged>::iterator begin, std::vector<staged>::iterator end)
+{
+	bool ok = true;
+	uint64_t from = begin->c.offset, to = 0;
+	try
+	{
+		Sql &filedata = database(node);
+		filedata.exec("begin");
+		try
+		{
+			for (auto i = begin; i != end; ++i)
+			{
+				preserve(filedata, i->c);
+				from = std::min(from, i->c.offset);
+				const uint64_t length = i->c.run < 0 ? -i->c.run : i->c.run ? i->c.run : i->c.data.size();
+				to = std::max<uint64_t>(to, i->c.offset + std::max<uint64_t>(length, 4096));
+			}
+			filedata.exec("commit");
+		}
+		catch (...)
+		{
+			filedata.exec("rollback");
+			throw;
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: writing history of node " << node << ": " << e.what() << std::endl;
+		databases.erase(node);
+		std::lock_guard<std::mutex> l(lock);
+		failed.insert(node);
+		ok = false;
+	}
+	
+	// the prefetcher may have seen these blocks before they were here
+	if (to > from)
+		block_cache.invalidate(node, from, to);
+	return ok;
+}
+
+Sql& capture_writer::database(node_id node)
+{
+	std::unique_ptr<Sql> &d = databases[node];
+	if (!d)
+	{
+		if (databases.size() > maxDatabases)
+		{
+			databases.clear();
+			return database(node);
+		}
+		const std::string filedataPath = std::string(dotCow+1) + "/filedata/" + std::to_string(node);
+		d.reset(new Sql);
+		d->open(filedataPath);
+		// a commit here is what lets the journal be emptied
+		d->exec("pragma synchronous = FULL");
+		d->exec("create table if not exists historical_filedata (offset integer primary key, data)");
+	}
+	return *d;
+}
+
+static const size_t default_capture_buffer_size = 64*1024*1024;
+static capture_writer captures;
+
+// what the history budget being used up makes fail with ENOSPC
+class history_full : public std::runtime_error
+{
+public:
+	history_full() : std::runtime_error("the history budget is used up") { }
+};
+
+// How much space .cow takes (as statfs reports it), kept up to date as
+// it's written to (what's captured and kept for snapshots, and a page for
+// each row), compacted and has snapshots dropped, and what's done when
+// there's a limit and it's reached. The total is kept in history.db while
+// it's not mounted; it's taken away for as long as it is, so that after a
+// crash, the next mount counts it again.
+class history_budget
+{
+public:
+	enum policy
+	{
+		refuse, // what would capture fails with ENOSPC
+		drop_snapshots, // the oldest snapshots go, then as refuse
+		stop_capturing // changes aren't captured until there's room
+	};
+	
+	// what a row of history costs besides its data, about a page
+	static const uint64_t row_overhead = 512;
+	
+private:
+	std::atomic<std::int64_t> used{0};
+	uint64_t limit=0;
+	policy over=refuse;
+	bool stopped=false;
+	
+public:
+	// 0 for none
+	void setLimit(uint64_t l) { limit = l; }
+	void setPolicy(policy p) { over = p; }
+	
+	uint64_t usage() const { const std::int64_t u = used; return u < 0 ? 0 : u; }
+	// what's left of the limit
+	uint64_t reserved() const { return limit > usage() ? limit-usage() : 0; }
+	
+	// what .cow took at the last unmount, or what's in it now if that's
+	// not known
+	void count();
+	// for the next mount
+	void save();
+	// so much more is in .cow, or less if it's negative
+	void add(std::int64_t bytes) { used += bytes; }
+	
+	// before about 'bytes' more are captured; false if they're not to be,
+	// and history_full is thrown if what would capture them is to fail
+	bool allows(uint64_t bytes);
+	// drop snapshots until it's within the limit, if that's the policy;
+	// before anything that may capture, outside of its transaction, as a
+	// snapshot's files can't be put back
+	void makeRoom();
+};
+
+static history_budget budget;
+
+struct cow_file_info;
+
+// What applications have written, and what that's cost in history, for
+// each historical file (by its history's node, so that it's the same file
+// when it's renamed) and in all, for /.cow/amplification. Only the FUSE
+// thread touches it.
+class capture_accounting
+{
+public:
+	struct counts
+	{
+		uint64_t written=0; // by applications
+		uint64_t preserved=0; // into the history by mergeData, data or clones
+		uint64_t skipped=0; // blocks that had been preserved already
+		uint64_t rows=0; // of historical_filedata
+	};
+	
+	// past this many files, they're only counted in all
+	static const size_t max_files = 100000;
+	
+private:
+	counts total;
+	std::map<node_id, counts> files;
+	uint64_t untracked=0;
+	
+	counts *of(node_id node);
+	
+public:
+	void written(cow_file_info *info, uint64_t bytes);
+	void preserved(cow_file_info *info, uint64_t bytes);
+	void skipped(cow_file_info *info, uint64_t blocks);
+	
+	// the totals, and the 'top' files that have cost the most history
+	std::string report(size_t top) const;
+};
+
+static capture_accounting accounting;
+
+// History only grows as it's written, so a thread of its own goes through
+// the files' databases (with connections of its own) and takes out what
+// isn't needed anymore:
+//   - extents whose blocks are back to what they were in the original, so
+//     that reading /.original finds them in the working file anyway, and
+//     what they had cloned into .cow/clones;
+//   - the pages that frees, and the write-ahead log.
+// A file is compacted when it's been changed (see ~cow_file_info), and
+// everything with history once at mount. Nothing is done to a file while
+// anything has it open (each cow_file_info of it uses() it, as it knows
+// which of its blocks are preserved) or any of its captures are staged,
+// and anything that would use it waits while an extent of it is being
+// looked at. It reads no more than 'rate' bytes a second, and waits while
+// .cow/compact.pause exists.
+class history_compactor
+{
+	// a file, as long as the working file is still at 'path' and unchanged
+	struct job
+	{
+		std::string path;
+		dev_t device;
+		ino_t inode;
+		struct timespec changed;
+		std::chrono::steady_clock::time_point after;
+	};
+	
+	// extents bigger than this are left alone, so as not to make
+	// anything wait for long
+	static const uint64_t maxExtent = 1024*1024;
+	
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake, idle;
+	std::map<node_id, job> jobs;
+	std::deque<node_id> order;
+	std::map<node_id, unsigned> users;
+	node_id compacting=0;
+	bool stopping=false;
+	
+	uint64_t rate=0;
+	double owed=0; // seconds to sleep for what's been read
+	std::atomic<uint64_t> reclaimedBytes{0};
+	
+	void run();
+	// false if the file can't be compacted now
+	bool compact(node_id node, const job &j);
+	bool claim(node_id node);
+	void unclaim();
+	bool same(const job &j, int fd);
+	bool rest(uint64_t bytes);
+	uint64_t usage(node_id node);
+	
+public:
+	// in bytes a second; 0 to never compact
+	void setRate(uint64_t r) { rate = r; }
+	
+	void start();
+	void stop();
+	
+	// compact the history of 'node', whose working file is 'path'
+	void request(node_id node, const std::string &path, const struct stat &st);
+	
+	// 'node' is in use by the foreground, which waits if an extent of it is
+	// being compacted
+	void use(node_id node)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		idle.wait(l, [&] { return compacting != node; });
+		users[node]++;
+	}
+	void done(node_id node)
+	{
+		std::lock_guard<std::mutex> l(lock);
+		const auto u = users.find(node);
+		if (u != users.end() && --u->second == 0)
+			users.erase(u);
+	}
+	
+	uint64_t reclaimed() const { return reclaimedBytes; }
+};
+
+static const uint64_t default_compact_rate = 16*1024*1024;
+static history_compactor compactor;
+
+struct cow_file_info
+{
+	int fd=-1;
+	bool is_original=false;
+	
+	// never true on "original"-path opens:
+	bool is_new; // as opposed to historical
+	bool is_historical=false; // as opposed to new
+	bool removed=false; // as opposed to still existing
+	bool is_directory=false; // this path is a directory name
+	
+	std::string oldpath; // the path of this file in the historic tree (before mv)
+	std::string newpath; // the path of this file in the working tree (after mv)
+	
+	// if not new, the command, if any
+	std::string command;
+	std::vector<unsigned char> commanddata;
+	
+	ssize_t original_file_size=-1;
+	
+	cow_file_info(const char *path);
+	
+	~cow_file_info();
+	
+	
+	// the database of this file's preserved blocks, created if need be
+	Sql& filedata()
+	{
+		if (is_directory)
+		{
+			throw std::runtime_error("tried to get filedata on directory");
+		}
+		open_filedata(true);
+		return file_database;
+	}
+	// whether any of this file's blocks have been preserved
+	bool has_filedata()
+	{
+		if (is_directory)
+			return false;
+		captures.wait(history_node());
+		return open_filedata(false);
+	}
+	
+	std::vector<bool> historical_blocks_present;
+	
+	// find the extent of historical_filedata that holds the block at offset 'block'
+	bool find_extent(uint64_t block, historical_extent &extent);
+	// the same, by way of block_cache
+	std::shared_ptr<const historical_block_cache::block> cached_extent(uint64_t block);
+	
+	// for noticing a reader going straight through the file
+	uint64_t next_read=0;
+	unsigned sequential_reads=0;
+	uint64_t prefetched_to=0;
+	
+	// the node of oldpath, once it has one
+	node_id history_node()
+	{
+		if (!historyNode)
+			uses(nodes.find(oldpath));
+		return historyNode;
+	}
+	// the same, made if need be
+	node_id make_history_node()
+	{
+		if (!historyNode)
+			uses(nodes.intern(oldpath));
+		return historyNode;
+	}
+	// before an operation that may preserve its blocks, outside of the
+	// operation's transaction: they're put in files named after the node,
+	// or staged for the capture writer, before it can be rolled back, so
+	// the node mustn't go with it
+	void prepare_history()
+	{
+		if (!is_new && !is_directory)
+			make_history_node();
+	}
+	// an operation on it was rolled back; if that took its node, what was
+	// opened under the node is no longer the file's
+	void rolled_back()
+	{
+		if (!historyNode || nodes.find(oldpath) == historyNode)
+			return;
+		compactor.done(historyNode);
+		historyNode = 0;
+		file_database.close();
+		if (clone_fd != -1)
+			::close(clone_fd);
+		clone_fd = -1;
+	}
+	
+	// some of its blocks were preserved (or found to be already), so it's
+	// compacted when it's done with
+	bool changed=false;
+	
+	// the file in .cow/clones that cloned extents of the original live in
+	int clones();
+	
+	// on opens of a report in /.cow, what it had then
+	bool is_report=false;
+	std::string report;
+	
+	// on opens in /.snapshots, the snapshot's first generation after it
+	// was taken, and its size of the file
+	bool is_snapshot=false;
+	std::int64_t snapshot_generation=0;
+	uint64_t snapshot_size=0;
+	// where the file's blocks are kept for snapshots
+	SnapshotStore snapshot_store;
+	
+	// what of the file has been kept for snapshots in the current
+	// generation (see snapshotData), when that was kept_generation
+	std::int64_t kept_generation=-1;
+	bool keeps_nothing=false;
+	uint64_t kept_size=0;
+	std::vector<bool> kept_blocks;
+	
+	static std::unique_ptr<cow_file_info> make(const char *path)
+	{
+		return std::unique_ptr<cow_file_info>(new cow_file_info(path));
+	}
+private:
+	bool open_filedata(bool create);
+	void uses(node_id node)
+	{
+		historyNode = node;
+		if (node)
+			compactor.use(node);
+	}
+	
+	Sql file_database;
+	int clone_fd=-1;
+	node_id historyNode=0;
+};
+
+cow_file_info::cow_file_info(const char *path)
+{
+	if (const dotcow_report make = report_of(path))
+	{
+		is_report = true;
+		is_new = true;
+		report = make();
+		return;
+	}
+	if (::is_snapshots(path))
+	{
+		// nothing of a snapshot is ever changed, so there's no history
+		is_snapshot = true;
+		is_new = true;
+		return;
+	}
+	
+	if (::is_original(path))
+	{
+		is_original = true;
+		is_new = false;
+		
+		if (strcmp(path, dotOriginal)==0)
+			path = "/";
+		else
+			path = path+sizeof(dotOriginal)-1;
+	}
+	
+	typedef Args<std::string,std::vector<unsigned char>> TwoStrings;
+	
+	if (is_original)
+	{
+		oldpath = path;
+		newpath = working_path(path);
+		is_historical = true; // later on, we might set this to false
+		
+		const node_id node = nodes.find(path);
+		if (maybe_recorded(node) && !history_index.command(node, command, commanddata))
+		{
+			db.statement("select command,data from historical_files where node=?")
+				.arg(node)
+				.exec(TwoStrings(), [&] (const TwoStrings::tuple &args)
+				{
+					command= std::get<0>(args);
+					commanddata = std::get<1>(args);
+				});
+		}
+		if (command == "erased" || command == "erased_link" || command == "rmdir")
+		{
+			newpath = "";
+			removed = true;
+		}
+		
+		// if it wasn't moved, what's there now may not be what was there
+		if (!removed && newpath == oldpath
+			&& (original_path(newpath) != newpath || is_new_path(newpath)))
+			is_historical = false;
+	}
+	else
+	{
+		newpath = path;
+		is_new = is_new_path(path);
+		is_historical = !is_new;
+		oldpath = is_new ? newpath : original_path(newpath);
+	}
+	
+	if (!is_new)
+	{
+		// if the file is not new, then its size is:
+		//   if the historical_filedata has a blocksize < 4096, then that is the last block
+		//   otherwise, it's the length of the true file
+		
+		if (!newpath.empty())
+		{
+			// if I don't know the end of the file from the historical_filedata,
+			// then it must be in the working dir
+			struct stat stbuf;
+			int res = ::fstatat( origin_fd, atdir(newpath.c_str()), &stbuf, 0);
+			if (res != -1)
+			{
+				original_file_size = stbuf.st_size;
+				is_directory = S_ISDIR(stbuf.st_mode);
+			}
+			else
+			{
+				is_historical = false;
+			}
+		}
+		
+		if (has_filedata())
+		{
+			try
+			{
+				// the last extent tells us where the original file ended,
+				// if it's not a whole number of blocks
+				original_file_size
+					= filedata().statement(std::string("select offset+len from ("
+							"select offset, ") + extentLength + " as len from historical_filedata "
+							"order by offset desc limit 1) "
+							"where len=0 or len%4096!=0"
+						)
+						.execValue<uint64_t>();
+			}
+			catch (no_rows&) { }
+		
+			// now let's gather a list of blocks that are present
+			const uint64_t sz
+				= file_database.statement("select coalesce(max(offset),0) from historical_filedata")
+					.execValue<uint64_t>();
+			
+			historical_blocks_present.resize((sz / 4096)+1, false);
+
+			file_database.statement(std::string("select offset, ") + extentLength + " from historical_filedata")
+				.exec(Args<uint64_t,uint64_t>(), [this] (const std::tuple<uint64_t,uint64_t> &t) 
+				{
+					const uint64_t offset = std::get<0>(t);
+					const uint64_t length = std::get<1>(t);
+					mark_present(historical_blocks_present, offset, length);
+				});
+		}
+	}
+}
+
+// the per-file databases are named after the node of the file's original path
+cow_file_info::~cow_file_info()
+{
+	if (historyNode)
+	{
+		compactor.done(historyNode);
+		
+		// only if it's still the working file
+		struct stat st, at;
+		if (changed && is_historical && !removed && fd != -1
+			&& ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+			&& ::fstatat(origin_fd, atdir(newpath.c_str()), &at, AT_SYMLINK_NOFOLLOW) == 0
+			&& st.st_dev == at.st_dev && st.st_ino == at.st_ino)
+			compactor.request(historyNode, newpath, st);
+	}
+	if (fd != -1)
+		::close(fd);
+	if (clone_fd != -1)
+		::close(clone_fd);
+}
+
+bool cow_file_info::open_filedata(bool create)
+{
+	if (file_database.isOpen())
+		return true;
+	
+	const node_id node = create ? make_history_node() : history_node();
+	if (node == 0)
+		return false;
+	
+	const std::string filedataPath = std::string(dotCow+1) + "/filedata/" + std::to_string(node);
+	if (!create && ::faccessat(origin_fd, filedataPath.c_str(), F_OK, 0) == -1)
+		return false;
+	
+	file_database.open(filedataPath);
+	file_database.exec("pragma synchronous = NORMAL");
+	file_database.exec("create table if not exists historical_filedata (offset integer primary key, data)");
+	return true;
+}
+
+bool cow_file_info::find_extent(uint64_t block, historical_extent &extent)
+{
+	if (!has_filedata())
+		return false;
+	try
+	{
+		std::tuple<uint64_t,uint64_t,std::int64_t,std::string> row
+			= filedata().statement(std::string("select offset, ") + extentLength + ", "
+				"case when typeof(data)='integer' then data else 0 end, data from historical_filedata "
+				"where offset<=? order by offset desc limit 1")
+				.arg(block)
+				.execTypes<uint64_t,uint64_t,std::int64_t,std::string>();
+		extent.offset = std::get<0>(row);
+		extent.length = std::get<1>(row);
+		extent.zeroes = std::get<2>(row) > 0;
+		extent.cloned = std::get<2>(row) < 0;
+		if (!extent.covers(block))
+			return false;
+		if (extent.zeroes || extent.cloned)
+			extent.data.clear();
+		else
+			extent.data = std::move(std::get<3>(row));
+		return true;
+	}
+	catch (no_rows&)
+	{
+		return false;
+	}
+}
+
+std::shared_ptr<const historical_block_cache::block> cow_file_info::cached_extent(uint64_t block)
+{
+	const node_id node = history_node();
+	captures.wait(node);
+	if (node)
+	{
+		std::shared_ptr<const historical_block_cache::block> b = block_cache.get(node, block);
+		if (b)
+			return b;
+	}
+	
+	std::shared_ptr<historical_block_cache::block> b = std::make_shared<historical_block_cache::block>();
+	b->found = find_extent(block, b->extent);
+	if (node)
+		block_cache.put(node, block, b);
+	return b;
+}
+
+int cow_file_info::clones()
+{
+	if (clone_fd == -1)
+	{
+		const std::string path = std::string(dotCow+1) + "/clones/" + std::to_string(make_history_node());
+		clone_fd = ::openat(origin_fd, path.c_str(), O_RDWR|O_CREAT, 0600);
+		if (clone_fd == -1)
+			throw std::runtime_error("failed to open " + path + ": " + std::to_string(errno));
+	}
+	return clone_fd;
+}
+
+// Reads of /.original files that go straight through the file get the
+// history of what's ahead put into block_cache by a thread of their own,
+// so that the query for the next blocks isn't made while the reader waits.
+// The thread has its own connection to the file's database, as a
+// connection can't be shared between threads.
+class original_prefetcher
+{
+	struct job
+	{
+		node_id node;
+		uint64_t begin, end;
+	};
+	
+	static const size_t maxJobs = 64;
+	
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<job> jobs;
+	bool stopping=false;
+	
+	node_id openNode=0;
+	std::unique_ptr<Sql> database; // of openNode, if it has one
+	
+	void run();
+	void prefetch(const job &j);
+	
+public:
+	void start()
+	{
+		thread = std::thread([this] { run(); });
+	}
+	void stop()
+	{
+		if (!thread.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+	
+	// get the history of 'node' from 'begin' up to 'end' into block_cache
+	void request(node_id node, uint64_t begin, uint64_t end)
+	{
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (jobs.size() >= maxJobs)
+				jobs.pop_front();
+			job j;
+			j.node = node;
+			j.begin = begin;
+			j.end = end;
+			jobs.push_back(j);
+		}
+		wake.notify_one();
+	}
+};
+
+void original_prefetcher::run()
+{
+	while (true)
+	{
+		job j;
+		{
+			std::unique_lock<std::mutex> l(lock);
+			wake.wait(l, [this] { return stopping || !jobs.empty(); });
+			if (stopping)
+				break;
+			j = jobs.front();
+			jobs.pop_front();
+		}
+		
+		try
+		{
+			prefetch(j);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: prefetching: " << e.what() << std::endl;
+			database.reset();
+			openNode = 0;
+		}
+	}
+	database.reset();
+}
+
+void original_prefetcher::prefetch(const job &j)
+{
+	if (openNode != j.node)
+	{
+		database.reset();
+		openNode = j.node;
+		const std::string filedataPath = std::string(dotCow+1) + "/filedata/" + std::to_string(j.node);
+		if (::faccessat(origin_fd, filedataPath.c_str(), F_OK, 0) == 0)
+		{
+			database.reset(new Sql);
+			database->open(filedataPath, Sql::Sql_WAL|Sql::Sql_NoCreate);
+		}
+	}
+	
+	const uint64_t since = block_cache.epoch();
+	
+	// the extents that cover the range, starting with the one that
+	// holds 'begin', if any
+	std::vector<std::shared_ptr<historical_block_cache::block>> extents;
+	if (database)
+	{
+		typedef Args<uint64_t,uint64_t,std::int64_t,std::string> Row;
+		database->statement(std::string("select offset, ") + extentLength + ", "
+				"case when typeof(data)='integer' then data else 0 end, data from historical_filedata "
+				"where offset<? and offset>=(select coalesce(max(offset),0) from historical_filedata where offset<=?) "
+				"order by offset")
+			.arg(j.end)
+			.arg(j.begin)
+			.exec(Row(), [&] (const Row::tuple &row)
+			{
+				std::shared_ptr<historical_block_cache::block> b = std::make_shared<historical_block_cache::block>();
+				b->found = true;
+				b->extent.offset = std::get<0>(row);
+				b->extent.length = std::get<1>(row);
+				b->extent.zeroes = std::get<2>(row) > 0;
+				b->extent.cloned = std::get<2>(row) < 0;
+				if (!b->extent.zeroes && !b->extent.cloned)
+					b->extent.data = std::get<3>(row);
+				extents.push_back(b);
+			});
+	}
+	
+	const std::shared_ptr<const historical_block_cache::block> missing
+		= std::make_shared<historical_block_cache::block>();
+	
+	size_t e = 0;
+	for (uint64_t block = j.begin; block < j.end; block += 4096)
+	{
+		while (e < extents.size() && extents[e]->extent.offset+std::max<uint64_t>(extents[e]->extent.length, 1) <= block)
+			e++;
+		if (e < extents.size() && extents[e]->extent.covers(block))
+			block_cache.put(j.node, block, extents[e], since);
+		else
+			block_cache.put(j.node, block, missing, since);
+	}
+}
+
+static original_prefetcher prefetcher;
+
+// what's under 'path' (relative to 'dirfd') takes on disk
+static uint64_t disk_usage(int dirfd, const char *path)
+{
+	struct stat st;
+	if (::fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return 0;
+	uint64_t bytes = uint64_t(st.st_blocks)*512;
+	if (!S_ISDIR(st.st_mode))
+		return bytes;
+	
+	const int fd = ::openat(dirfd, path, O_DIRECTORY|O_CLOEXEC);
+	if (DIR *const d = fd == -1 ? nullptr : fdopendir(fd))
+	{
+		while (const dirent *const entry = readdir(d))
+		{
+			if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+				bytes += disk_usage(fd, entry->d_name);
+		}
+		closedir(d);
+	}
+	return bytes;
+}
+
+void history_budget::count()
+{
+	db.exec("create table if not exists history_usage (bytes integer)");
+	try
+	{
+		used = db.statement("select bytes from history_usage").execValue<std::uint64_t>();
+	}
+	catch (no_rows&)
+	{
+		used = disk_usage(origin_fd, dotCow+1);
+	}
+	db.exec("delete from history_usage");
+}
+
+void history_budget::save()
+{
+	try
+	{
+		db.statement("insert into history_usage values(?)").arg(usage()).exec();
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: failed to save the history's size: " << e.what() << std::endl;
+	}
+}
+
+bool history_budget::allows(uint64_t bytes)
+{
+	if (limit == 0 || usage() + bytes <= limit)
+	{
+		if (stopped)
+			std::cerr << "there's room in the history budget, changes are captured again" << std::endl;
+		stopped = false;
+		return true;
+	}
+	// makeRoom() drops them before the next change
+	if (over == drop_snapshots && snapshots.any())
+		return true;
+	if (over == stop_capturing)
+	{
+		if (!stopped)
+			std::cerr << "warning: the history budget of " << limit << " bytes is used up, "
+				"changes aren't being captured" << std::endl;
+		stopped = true;
+		return false;
+	}
+	throw history_full();
+}
+
+void history_budget::makeRoom()
+{
+	if (limit == 0 || over != drop_snapshots)
+		return;
+	while (usage() > limit && snapshots.any())
+	{
+		std::string name;
+		uint64_t freed;
+		try
+		{
+			if (!snapshots.dropOldest(name, freed))
+				break;
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: dropping a snapshot: " << e.what() << std::endl;
+			break;
+		}
+		add(-std::int64_t(freed));
+		std::cerr << "dropped snapshot " << name << " to stay within the history budget" << std::endl;
+	}
+}
+
+capture_accounting::counts *capture_accounting::of(node_id node)
+{
+	const auto found = files.find(node);
+	if (found != files.end())
+		return &found->second;
+	if (files.size() == max_files)
+	{
+		untracked++;
+		return nullptr;
+	}
+	return &files[node];
+}
+
+void capture_accounting::written(cow_file_info *info, uint64_t bytes)
+{
+	total.written += bytes;
+	if (info->is_new)
+		return;
+	// which has no history yet if nothing of it was preserved
+	const node_id node = info->history_node();
+	if (!node)
+		return;
+	if (counts *const c = of(node))
+		c->written += bytes;
+}
+
+void capture_accounting::preserved(cow_file_info *info, uint64_t bytes)
+{
+	total.preserved += bytes;
+	total.rows++;
+	if (counts *const c = of(info->make_history_node()))
+	{
+		c->preserved += bytes;
+		c->rows++;
+	}
+}
+
+void capture_accounting::skipped(cow_file_info *info, uint64_t blocks)
+{
+	total.skipped += blocks;
+	if (counts *const c = of(info->make_history_node()))
+		c->skipped += blocks;
+}
+
+std::string capture_accounting::report(size_t top) const
+{
+	const auto line = [] (std::ostream &o, const counts &c)
+	{
+		o << c.written << " bytes written, " << c.preserved << " preserved";
+		if (c.written)
+			o << " (" << std::fixed << std::setprecision(2) << double(c.preserved)/c.written << " per byte written)";
+		o << ", " << c.skipped << " blocks already preserved, " << c.rows << " rows\n";
+	};
+	
+	std::ostringstream o;
+	o << "all: ";
+	line(o, total);
+	if (untracked)
+		o << "(" << untracked << " changes to files past the first " << max_files << " are only in all)\n";
+	
+	std::vector<std::pair<node_id, const counts*>> hottest;
+	for (const auto &file : files)
+		hottest.push_back(std::make_pair(file.first, &file.second));
+	const auto costlier = [] (const std::pair<node_id, const counts*> &a,
+		const std::pair<node_id, const counts*> &b)
+	{
+		return a.second->preserved > b.second->preserved;
+	};
+	top = std::min(top, hottest.size());
+	std::partial_sort(hottest.begin(), hottest.begin()+top, hottest.end(), costlier);
+	for (size_t i=0; i < top; i++)
+	{
+		// where it is now
+		o << "\n" << working_path(nodes.path(hottest[i].first)) << "\n\t";
+		line(o, *hottest[i].second);
+	}
+	return o.str();
+}
+
+// how many files /.cow/amplification lists
+static const size_t amplification_top = 20;
+
+static std::string amplification_report()
+{
+	return accounting.report(amplification_top);
+}
+
+static const char compactPausePath[] = ".cow/compact.pause";
+
+void history_compactor::start()
+{
+	if (rate == 0)
+		return;
+	thread = std::thread([this] { run(); });
+}
+
+void history_compactor::stop()
+{
+	if (!thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> l(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	thread.join();
+}
+
+void history_compactor::request(node_id node, const std::string &path, const struct stat &st)
+{
+	if (rate == 0)
+		return;
+	{
+		std::lock_guard<std::mutex> l(lock);
+		if (!jobs.count(node))
+			order.push_back(node);
+		job &j = jobs[node];
+		j.path = path;
+		j.device = st.st_dev;
+		j.inode = st.st_ino;
+		j.changed = st.st_ctim;
+		j.after = std::chrono::steady_clock::now();
+	}
+	wake.notify_one();
+}
+
+void history_compactor::run()
+{
+	while (true)
+	{
+		node_id node;
+		job j;
+		{
+			std::unique_lock<std::mutex> l(lock);
+			wake.wait(l, [this] { return stopping || !order.empty(); });
+			if (stopping)
+				break;
+			node = order.front();
+			if (wake.wait_until(l, jobs[node].after, [this] { return stopping; }))
+				break;
+			// as it may have been asked for again meanwhile
+			j = jobs[node];
+			jobs.erase(node);
+			order.pop_front();
+		}
+		
+		const uint64_t before = usage(node);
+		bool done = true;
+		try
+		{
+			done = compact(node, j);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: compacting history of node " << node << ": " << e.what() << std::endl;
+		}
+		const uint64_t after = usage(node);
+		if (after < before)
+		{
+			reclaimedBytes += before-after;
+			budget.add(-std::int64_t(before-after));
+		}
+		
+		if (!done)
+		{
+			// in use, so try again in a while
+			std::lock_guard<std::mutex> l(lock);
+			if (!jobs.count(node))
+			{
+				j.after = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+				jobs[node] = j;
+				order.push_back(node);
+			}
+		}
+	}
+}
+
+bool history_compactor::claim(node_id node)
+{
+	std::lock_guard<std::mutex> l(lock);
+	if (users.count(node) || !captures.idle(node))
+		return false;
+	compacting = node;
+	return true;
+}
+
+void history_compactor::unclaim()
+{
+	{
+		std::lock_guard<std::mutex> l(lock);
+		compacting = 0;
+	}
+	idle.notify_all();
+}
+
+// whether 'fd' is still the job's working file, as it was then
+bool history_compactor::same(const job &j, int fd)
+{
+	struct stat st, at;
+	return ::fstat(fd, &st) == 0
+		&& ::fstatat(origin_fd, atdir(j.path.c_str()), &at, AT_SYMLINK_NOFOLLOW) == 0
+		&& st.st_dev == j.device && st.st_ino == j.inode
+		&& st.st_ctim.tv_sec == j.changed.tv_sec && st.st_ctim.tv_nsec == j.changed.tv_nsec
+		&& at.st_dev == st.st_dev && at.st_ino == st.st_ino;
+}
+
+// sleep for what's been read, and while paused; false if it's stopping
+bool history_compactor::rest(uint64_t bytes)
+{
+	owed += double(bytes)/rate;
+	std::unique_lock<std::mutex> l(lock);
+	if (owed >= 0.01)
+	{
+		wake.wait_for(l, std::chrono::duration<double>(owed), [this] { return stopping; });
+		owed = 0;
+	}
+	while (!stopping && ::faccessat(origin_fd, compactPausePath, F_OK, 0) == 0)
+		wake.wait_for(l, std::chrono::seconds(1), [this] { return stopping; });
+	return !stopping;
+}
+
+// the space the history of 'node' takes
+uint64_t history_compactor::usage(node_id node)
+{
+	const std::string name = std::to_string(node);
+	uint64_t bytes = 0;
+	for (const std::string &path : {
+		std::string(dotCow+1) + "/filedata/" + name,
+		std::string(dotCow+1) + "/filedata/" + name + "-wal",
+		std::string(dotCow+1) + "/clones/" + name })
+	{
+		struct stat st;
+		if (::fstatat(origin_fd, path.c_str(), &st, 0) == 0)
+			bytes += uint64_t(st.st_blocks)*512;
+	}
+	return bytes;
+}
+
+bool history_compactor::compact(node_id node, const job &j)
+{
+	const std::string filedataPath = std::string(dotCow+1) + "/filedata/" + std::to_string(node);
+	const std::string clonesPath = std::string(dotCow+1) + "/clones/" + std::to_string(node);
+	if (::faccessat(origin_fd, filedataPath.c_str(), F_OK, 0) == -1)
+		return true;
+	
+	struct descriptor
+	{
+		int fd=-1;
+		~descriptor() { if (fd != -1) ::close(fd); }
+	} working, clones;
+	working.fd = ::openat(origin_fd, atdir(j.path.c_str()), O_RDONLY|O_CLOEXEC);
+	if (working.fd == -1 || !same(j, working.fd))
+		return true;
+	
+	// what's claimed, so the foreground waits for it
+	struct holding
+	{
+		history_compactor &c;
+		bool held=false;
+		holding(history_compactor &c) : c(c) { }
+		~holding() { if (held) c.unclaim(); }
+	};
+	
+	// whole extents, and none that says where the original ended
+	typedef Args<uint64_t,uint64_t,std::int64_t> Extent;
+	std::vector<Extent::tuple> extents;
+	Sql filedata;
+	{
+		holding h(*this);
+		if (!claim(node))
+			return false;
+		h.held = true;
+		filedata.open(filedataPath, Sql::Sql_WAL|Sql::Sql_NoCreate);
+		filedata.statement(std::string("select offset, ") + extentLength + ", "
+				"case when typeof(data)='integer' then data else 0 end from historical_filedata "
+				"where " + extentLength + "%4096=0 and " + extentLength + " between 4096 and ? order by offset")
+			.arg(uint64_t(maxExtent))
+			.exec(Extent(), [&] (const Extent::tuple &e)
+			{
+				extents.push_back(e);
+			});
+	}
+	
+	std::vector<char> now, then;
+	uint64_t read = 0;
+	bool dropped = false;
+	for (const Extent::tuple &e : extents)
+	{
+		if (!rest(read))
+			return true;
+		read = 0;
+		
+		holding h(*this);
+		if (!claim(node))
+			return false;
+		h.held = true;
+		if (!same(j, working.fd))
+			return true;
+		
+		const uint64_t offset = std::get<0>(e), length = std::get<1>(e);
+		const std::int64_t run = std::get<2>(e);
+		now.resize(length);
+		if (::pread(working.fd, now.data(), length, offset) != ssize_t(length))
+			continue;
+		read += length;
+		
+		bool back;
+		if (run > 0)
+		{
+			back = is_zero(now.data(), length);
+		}
+		else if (run < 0)
+		{
+			if (clones.fd == -1)
+				clones.fd = ::openat(origin_fd, clonesPath.c_str(), O_RDWR|O_CLOEXEC);
+			then.resize(length);
+			back = clones.fd != -1
+				&& ::pread(clones.fd, then.data(), length, offset) == ssize_t(length)
+				&& std::memcmp(now.data(), then.data(), length) == 0;
+			read += length;
+		}
+		else
+		{
+			const std::string data = filedata.statement("select data from historical_filedata where offset=?")
+				.arg(offset)
+				.execValue<std::string>();
+			back = data.size() == length && std::memcmp(now.data(), data.data(), length) == 0;
+		}
+		if (!back)
+			continue;
+		
+		filedata.statement("delete from historical_filedata where offset=?").arg(offset).exec();
+		block_cache.invalidate(node, offset, offset+length);
+		if (run < 0)
+			::fallocate(clones.fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length);
+		dropped = true;
+	}
+	if (!dropped || !rest(read))
+		return true;
+	
+	holding h(*this);
+	if (!claim(node))
+		return true;
+	h.held = true;
+	
+	if (clones.fd != -1
+		&& filedata.statement("select count(*) from historical_filedata where typeof(data)='integer' and data<0")
+			.execValue<unsigned>() == 0)
+		::unlinkat(origin_fd, clonesPath.c_str(), 0);
+	
+	// the database stays, even if it's empty, as the capture writer may
+	// have a connection to it
+	const uint64_t freePages = filedata.statement("pragma freelist_count").execValue<uint64_t>();
+	const uint64_t pages = filedata.statement("pragma page_count").execValue<uint64_t>();
+	if (freePages*4 >= pages)
+		filedata.exec("vacuum");
+	filedata.exec("pragma wal_checkpoint(TRUNCATE)");
+	return true;
+}
+
+// how far ahead of a reader that's going straight through a file to read
+static const uint64_t prefetch_window = 1024*1024;
+
+// 'info' has just been read from 'begin' up to 'end'
+static void read_ahead(cow_file_info *const info, uint64_t begin, uint64_t end)
+{
+	if (begin != info->next_read)
+	{
+		info->sequential_reads = 0;
+		info->prefetched_to = 0;
+	}
+	else
+		info->sequential_reads++;
+	info->next_read = end;
+	
+	// it takes a few reads in a row to look like a stream
+	if (info->sequential_reads < 2 || info->prefetched_to >= end + prefetch_window/2)
+		return;
+	
+	const uint64_t from = std::max(info->prefetched_to, (end >> 12) << 12);
+	uint64_t to = end + prefetch_window;
+	if (info->original_file_size != -1)
+		to = std::min<uint64_t>(to, uint64_t(info->original_file_size) + 4096);
+	if (from >= to)
+		return;
+	info->prefetched_to = to;
+	
+	if (info->fd != -1)
+		::posix_fadvise(info->fd, from, to-from, POSIX_FADV_WILLNEED);
+	if (const node_id node = info->history_node())
+		prefetcher.request(node, from, to);
+}
+
+// split a path in /.snapshots into the name of a snapshot and the path in it
+static bool snapshot_path(const char *path, std::string &name, std::string &rest)
+{
+	path += sizeof(dotSnapshots)-1;
+	if (*path != '/' || path[1] == '\0')
+		return false;
+	const char *const slash = std::strchr(path+1, '/');
+	if (slash)
+	{
+		name.assign(path+1, slash);
+		rest = slash;
+	}
+	else
+	{
+		name = path+1;
+		rest = "/";
+	}
+	return true;
+}
+
+// what 'path' in a snapshot is now, if it's in it
+static bool find_snapshot(
+	const char *path, Snapshots::Point &point, Snapshots::Entry &entry,
+	std::vector<std::string> *trail=nullptr
+)
+{
+	std::string name, rest;
+	if (!snapshot_path(path, name, rest) || !snapshots.find(name, point))
+		return false;
+	entry = snapshots.resolve(point, rest, trail);
+	if (entry.kind == Snapshots::Entry::Live && is_dotcow(entry.path.c_str()))
+		return false;
+	return entry.kind != Snapshots::Entry::Missing;
+}
+
+// the size a file that's 'now' long had in the snapshot
+static uint64_t snapshot_size(SnapshotStore &store, std::int64_t generation, uint64_t now)
+{
+	uint64_t size;
+	if (store.isOpen() && store.size(generation, size))
+		return size;
+	return now;
+}
+
+static int snapshot_getattr(const char *path, struct stat *stbuf)
+{
+	if (strcmp(path, dotSnapshots)==0)
+	{
+		if (::fstat(origin_fd, stbuf) == -1)
+			return -errno;
+	}
+	else
+	{
+		Snapshots::Point point;
+		Snapshots::Entry entry;
+		if (!find_snapshot(path, point, entry))
+			return -ENOENT;
+		
+		SnapshotStore store;
+		if (entry.kind == Snapshots::Entry::Live)
+		{
+			if (::fstatat(origin_fd, atdir(entry.path.c_str()), stbuf, AT_SYMLINK_NOFOLLOW) == -1)
+				return -errno;
+			const std::int64_t id = S_ISREG(stbuf->st_mode) ? snapshots.storeOf(stbuf->st_ino, false) : 0;
+			if (id)
+				store.open(id, false);
+		}
+		else
+		{
+			*stbuf = deserialize_stat(entry.stat);
+			if (entry.kind == Snapshots::Entry::Erased)
+				store.open(entry.store, false);
+		}
+		stbuf->st_size = snapshot_size(store, point.generation, stbuf->st_size);
+	}
+	// nothing in a snapshot can be changed
+	stbuf->st_mode &= ~0222;
+	return 0;
+}
+
+// /.cow, which only has the reports in it
+static int dotcow_getattr(const char *path, struct stat *stbuf)
+{
+	const bool dir = std::strcmp(path, dotCow) == 0;
+	const dotcow_report report = report_of(path);
+	if (!dir && !report)
+		return -ENOENT;
+	if (::fstat(origin_fd, stbuf) == -1)
+		return -errno;
+	stbuf->st_ino = 0;
+	if (dir)
+	{
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		stbuf->st_size = 0;
+	}
+	else
+	{
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = report().size();
+		stbuf->st_blocks = 0;
+	}
+	return 0;
+}
+
+static int cow_getattr(const char *path, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	if (is_dotcow(path))
+		return dotcow_getattr(path, stbuf);
+	if (is_snapshots(path))
+	{
+		try
+		{
+			return snapshot_getattr(path, stbuf);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+	}
+	
+	if (is_original(path))
+	{
+		const std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
+		if (!info->is_historical)
+			return -ENOENT;
+		
+		if (info->is_new)
+			return -ENOENT;
+		
+		if (info->command == "rmdir" || info->command == "erased" || info->command == "erased_link")
+		{
+			*stbuf = deserialize_stat(info->commanddata);
+		}
+		else
+		{
+			const int res = ::fstatat( origin_fd, atdir(info->newpath.c_str()), stbuf, 0);
+			if (res == -1)
+			{
+				std::cerr << "failed to fstat the file [origin]" << info->newpath << " which should be there" << std::endl;
+				return -1;
+			}
+			stbuf->st_size = info->original_file_size;
+		}
+		return 0;
+	}
+	else
+	{
+		int res = ::fstatat( origin_fd, atdir(path), stbuf, 0);
+		if (res==0)
+			return 0;
+		else
+			return -errno;
+	}
+}
+
+// a complete listing of a directory of /.original: names and their d_type
+typedef std::vector<std::pair<std::string, unsigned char>> original_listing;
+
+// listings of /.original directories that have been read to the end are
+// kept, so the next reader doesn't query the history or scan the working
+// tree again. Each directory has a generation that is bumped by anything
+// that creates, removes or renames something in it; a listing made at an
+// older generation than its directory's is never cached. The generation
+// that counts is that of where the directory is in the working tree, so
+// a listing is also stale once the directory (or a parent) is renamed.
+//
+// Generations all come from one counter. Only so many directories' are
+// remembered; when there are more, they're forgotten, and every directory
+// then has the generation of the last change, which makes anything listed
+// before it stale.
+static const size_t listing_cache_directories = 1024;
+static const size_t listing_cache_max_entries = 100000;
+static const size_t listing_generations_kept = 4*listing_cache_directories;
+
+struct cached_listing
+{
+	std::string working;
+	uint64_t generation;
+	std::shared_ptr<const original_listing> listing;
+	std::list<std::string>::iterator lru;
+};
+static std::map<std::string, uint64_t> directory_generations;
+static uint64_t last_generation=0, forgotten_generation=0;
+static std::map<std::string, cached_listing> listing_cache;
+static std::list<std::string> listing_lru; // most recently used first
+
+static std::string parent_directory(const std::string &path)
+{
+	const size_t slash = path.rfind('/');
+	if (slash == 0 || slash == std::string::npos)
+		return "/";
+	return path.substr(0, slash);
+}
+
+static uint64_t directory_generation(const std::string &dir)
+{
+	const auto i = directory_generations.find(dir);
+	if (i == directory_generations.end())
+		return forgotten_generation;
+	return i->second;
+}
+
+// something named 'path' was created, removed or renamed
+static void directory_changed(const char *path)
+{
+	if (directory_generations.size() >= listing_generations_kept)
+	{
+		directory_generations.clear();
+		forgotten_generation = last_generation;
+	}
+	directory_generations[parent_directory(path)] = ++last_generation;
+}
+
+static std::shared_ptr<const original_listing> cached_original_listing(
+	const std::string &dir, const std::string &working
+)
+{
+	const auto i = listing_cache.find(dir);
+	if (i == listing_cache.end())
+		return nullptr;
+	if (i->second.working != working || i->second.generation != directory_generation(working))
+	{
+		listing_lru.erase(i->second.lru);
+		listing_cache.erase(i);
+		return nullptr;
+	}
+	listing_lru.splice(listing_lru.begin(), listing_lru, i->second.lru);
+	return i->second.listing;
+}
+
+static void cache_original_listing(
+	const std::string &dir, const std::string &working, uint64_t generation,
+	const std::shared_ptr<const original_listing> &listing
+)
+{
+	if (directory_generation(working) != generation || listing_cache.count(dir))
+		return;
+	
+	if (listing_cache.size() >= listing_cache_directories)
+	{
+		listing_cache.erase(listing_lru.back());
+		listing_lru.pop_back();
+	}
+	listing_lru.push_front(dir);
+	cached_listing &c = listing_cache[dir];
+	c.working = working;
+	c.generation = generation;
+	c.listing = listing;
+	c.lru = listing_lru.begin();
+}
+
+// a directory listing of /.original, which is the directory in the working
+// tree, minus what's new there, plus what has been removed or renamed away.
+// Kept for the life of the handle so readdir can resume where it left off.
+struct original_dir
+{
+	std::string path;
+	std::string working; // where it is in the working tree, if it's there
+	uint64_t generation;
+	
+	// if set, the entries come from here instead
+	std::shared_ptr<const original_listing> cached;
+	
+	DIR *d=nullptr; // the directory in the working tree, if it still exists
+	
+	std::set<std::string> hidden; // names in the working tree that aren't in the original
+	std::vector<std::string> extra; // names only in the original
+	
+	off_t position=0; // the offset of the next entry
+	size_t nextExtra=0;
+	
+	// what has been read so far, for the cache; null if it's too big
+	std::shared_ptr<original_listing> building;
+	
+	original_dir(const char *path);
+	~original_dir()
+	{
+		if (d)
+			closedir(d);
+	}
+	
+	// get the next entry, false at the end
+	bool next(std::string &name, unsigned char &type);
+	// put back the entry that next() just returned
+	void unread();
+	
+	void rewind()
+	{
+		if (d)
+			rewinddir(d);
+		position = 0;
+		nextExtra = 0;
+		if (!cached)
+			building = std::make_shared<original_listing>();
+	}
+	
+private:
+	long lastDirPosition=0;
+	size_t lastExtra=0;
+};
+
+original_dir::original_dir(const char *path)
+	: path(path)
+{
+	const node_id dir = nodes.find(path);
+	bool removed = false;
+	if (dir)
+	{
+		removed = db.statement("select count(*) from historical_files where node=? and command='rmdir'")
+			.arg(dir).execValue<unsigned>() > 0;
+	}
+	if (!removed)
+		working = working_path(path);
+	generation = directory_generation(working);
+	
+	cached = cached_original_listing(path, working);
+	if (cached)
+		return;
+	building = std::make_shared<original_listing>();
+	
+	if (dir)
+	{
+		db
+			.statement("select name from historical_files join nodes on id=node where parent=? "
+				"and (command='erased' or command='erased_link' or command='rmdir' or command='rename')")
+			.arg(dir)
+			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &name)
+			{
+				extra.push_back(std::get<0>(name));
+			});
+	}
+	
+	// what's in the working directory that doesn't come from here
+	const node_id workingDir = working.empty() ? 0 : nodes.find(working);
+	if (workingDir)
+	{
+		db
+			.statement("select name from historical_files join nodes on id=data where parent=? "
+				"and command='rename'")
+			.arg(workingDir)
+			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &name)
+			{
+				hidden.insert(std::get<0>(name));
+			});
+		
+		db
+			.statement("select name from new_files join nodes on id=node where parent=?")
+			.arg(workingDir)
+			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &name)
+			{
+				hidden.insert(std::get<0>(name));
+			});
+	}
+	
+	if (!working.empty() && !is_new_path(working))
+	{
+		const int dfd = ::openat(origin_fd, atdir(working.c_str()), O_DIRECTORY);
+		if (dfd != -1)
+		{
+			d = fdopendir(dfd);
+			if (!d)
+				::close(dfd);
+		}
+	}
+}
+
+bool original_dir::next(std::string &name, unsigned char &type)
+{
+	if (cached)
+	{
+		if (size_t(position) >= cached->size())
+			return false;
+		name = (*cached)[position].first;
+		type = (*cached)[position].second;
+		position++;
+		return true;
+	}
+	
+	lastDirPosition = d ? telldir(d) : 0;
+	lastExtra = nextExtra;
+	
+	bool got = false;
+	while (d)
+	{
+		const dirent *const entry = readdir(d);
+		if (!entry)
+			break;
+		if (hidden.count(entry->d_name))
+			continue;
+		
+		name = entry->d_name;
+		type = entry->d_type;
+		got = true;
+		break;
+	}
+	
+	if (!got && nextExtra < extra.size())
+	{
+		name = extra[nextExtra++];
+		type = DT_UNKNOWN;
+		got = true;
+	}
+	
+	if (!got)
+	{
+		// that's all of it, so the next reader can have it
+		if (building)
+			cache_original_listing(path, working, generation, building);
+		building.reset();
+		return false;
+	}
+	
+	position++;
+	if (building && building->size() < listing_cache_max_entries)
+		building->push_back(std::make_pair(name, type));
+	else
+		building.reset();
+	return true;
+}
+
+void original_dir::unread()
+{
+	position--;
+	if (cached)
+		return;
+	if (d)
+		seekdir(d, lastDirPosition);
+	nextExtra = lastExtra;
+	if (building)
+		building->pop_back();
+}
+
+// the listing of a directory in /.snapshots: what's in it now, except
+// that whatever's been logged in it (or where it's been) since the
+// snapshot was taken is looked up on its own
+static int snapshot_listing(const char *path, original_listing &listing)
+{
+	listing.push_back(std::make_pair(".", DT_DIR));
+	listing.push_back(std::make_pair("..", DT_DIR));
+	if (strcmp(path, dotSnapshots)==0)
+	{
+		for (const std::string &name : snapshots.names())
+			listing.push_back(std::make_pair(name, DT_DIR));
+		return 0;
+	}
+	
+	Snapshots::Point point;
+	Snapshots::Entry entry;
+	std::vector<std::string> trail;
+	if (!find_snapshot(path, point, entry, &trail))
+		return -ENOENT;
+	if (entry.kind == Snapshots::Entry::Erased)
+		return -ENOTDIR;
+	
+	std::string name, dir;
+	snapshot_path(path, name, dir);
+	if (dir == "/")
+		dir.clear();
+	
+	const std::set<std::string> logged = snapshots.logged(point, trail);
+	if (entry.kind == Snapshots::Entry::Live)
+	{
+		const int dfd = ::openat(origin_fd, atdir(entry.path.c_str()), O_DIRECTORY);
+		if (dfd == -1)
+			return -errno;
+		DIR *const d = fdopendir(dfd);
+		if (!d)
+		{
+			::close(dfd);
+			return -EIO;
+		}
+		while (const dirent *const e = readdir(d))
+		{
+			if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0)
+				continue;
+			if (entry.path == "/" && std::strcmp(e->d_name, dotCow+1) == 0)
+				continue;
+			if (logged.count(e->d_name) == 0)
+				listing.push_back(std::make_pair(e->d_name, e->d_type));
+		}
+		closedir(d);
+	}
+	
+	for (const std::string &n : logged)
+	{
+		const Snapshots::Entry e = snapshots.resolve(point, dir + "/" + n);
+		struct stat st;
+		if (e.kind == Snapshots::Entry::Missing)
+			continue;
+		else if (e.kind == Snapshots::Entry::Live)
+		{
+			if (is_dotcow(e.path.c_str())
+				|| ::fstatat(origin_fd, atdir(e.path.c_str()), &st, AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+		}
+		else
+			st = deserialize_stat(e.stat);
+		listing.push_back(std::make_pair(n, IFTODT(st.st_mode)));
+	}
+	return 0;
+}
+
+static int cow_opendir(const char *path, struct fuse_file_info *fi)
+{
+	if (is_dotcow(path))
+	{
+		if (std::strcmp(path, dotCow) != 0)
+			return -ENOENT;
+		std::unique_ptr<original_listing> listing(new original_listing);
+		listing->push_back(std::make_pair(std::string("."), DT_DIR));
+		listing->push_back(std::make_pair(std::string(".."), DT_DIR));
+		for (const auto &report : dotCowReports)
+			listing->push_back(std::make_pair(std::string(report.first), DT_REG));
+		fi->fh = reinterpret_cast<uint64_t>(listing.release());
+		return 0;
+	}
+	if (is_snapshots(path))
+	{
+		try
+		{
+			std::unique_ptr<original_listing> listing(new original_listing);
+			const int r = snapshot_listing(path, *listing);
+			if (r)
+				return r;
+			fi->fh = reinterpret_cast<uint64_t>(listing.release());
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+		return 0;
+	}
+	if (is_original(path))
+	{
+		if (strcmp(path, dotOriginal)==0)
+			path = "/";
+		else
+			path = path+sizeof(dotOriginal)-1;
+		
+		try
+		{
+			fi->fh = reinterpret_cast<uint64_t>(new original_dir(path));
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+		return 0;
+	}
+	else
+	{
+		int dfd = ::openat(origin_fd, atdir(path), O_DIRECTORY);
+		if (dfd == -1)
+			return -errno;
+		
+		DIR *d = fdopendir(dfd);
+		if (!d)
+			return -errno;
+		
+		fi->fh = reinterpret_cast<uint64_t>(d);
+		return 0;
+	}
+}
+
+// entries are given to filler with the offset of the entry that follows
+// them, so a listing that doesn't fit is resumed by another call with that
+// offset rather than starting over
+static int cow_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	struct stat st;
+	std::memset(&st, 0, sizeof(st));
+	
+	// /.cow is listed as the snapshots are
+	if (is_snapshots(path) || is_dotcow(path))
+	{
+		const original_listing &listing = *reinterpret_cast<original_listing*>(fi->fh);
+		for (size_t i = offset; i < listing.size(); i++)
+		{
+			st.st_mode = DTTOIF(listing[i].second);
+			if (filler(buf, listing[i].first.c_str(), &st, i+1))
+				break;
+		}
+		return 0;
+	}
+	else if (is_original(path))
+	{
+		const bool root = strcmp(path, dotOriginal)==0;
+		original_dir *const dir = reinterpret_cast<original_dir*>(fi->fh);
+		
+		if (offset != dir->position)
+		{
+			dir->rewind();
+			std::string name;
+			unsigned char type;
+			while (dir->position < offset && dir->next(name, type))
+				;
+		}
+		
+		while (true)
+		{
+			std::string name;
+			unsigned char type;
+			if (!dir->next(name, type))
+				break;
+			if (root && name == dotCow+1)
+				continue;
+			
+			st.st_mode = DTTOIF(type);
+			if (filler(buf, name.c_str(), &st, dir->position))
+			{
+				// it didn't fit, so put it back for next time
+				dir->unread();
+				break;
+			}
+		}
+		return 0;
+	}
+	else
+	{
+		const bool root = strcmp(path, "/")==0;
+		DIR *d = reinterpret_cast<DIR*>(fi->fh);
+		
+		if (offset != telldir(d))
+		{
+			if (offset == 0)
+				rewinddir(d);
+			else
+				seekdir(d, offset);
+		}
+		
+		while (true)
+		{
+			const long before = telldir(d);
+			const dirent *const entry = readdir(d);
+			if (!entry)
+				break;
+			if (root && std::strcmp(entry->d_name, dotCow+1) == 0)
+				continue;
+			
+			st.st_ino = entry->d_ino;
+			st.st_mode = DTTOIF(entry->d_type);
+			if (filler(buf, entry->d_name, &st, telldir(d)))
+			{
+				seekdir(d, before);
+				break;
+			}
+		}
+		
+		return 0;
+	}
+}
+
+static int cow_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	if (is_snapshots(path) || is_dotcow(path))
+	{
+		delete reinterpret_cast<original_listing*>(fi->fh);
+	}
+	else if (is_original(path))
+	{
+		delete reinterpret_cast<original_dir*>(fi->fh);
+	}
+	else
 	{
 		DIR *d = reinterpret_cast<DIR*>(fi->fh);
 		closedir(d);
@@ -525,10 +2814,108 @@ static int cow_releasedir(const char *path, struct fuse_file_info *fi)
 }
 
 
+// a file in a snapshot is read from where it is now, or from its store
+// if it's been erased since, except for the blocks kept since it was taken
+static int snapshot_open(const char *path, struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		return -EACCES;
+	
+	Snapshots::Point point;
+	Snapshots::Entry entry;
+	if (!find_snapshot(path, point, entry))
+		return -ENOENT;
+	if (entry.kind == Snapshots::Entry::RemovedDir)
+		return -EISDIR;
+	
+	std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
+	const bool live = entry.kind == Snapshots::Entry::Live;
+	const std::string file = live ? atdir(entry.path.c_str()) : Snapshots::storeFile(entry.store);
+	info->fd = ::openat(origin_fd, file.c_str(), O_RDONLY);
+	if (info->fd == -1)
+		return -errno;
+	
+	struct stat st;
+	if (::fstat(info->fd, &st) == -1)
+		return -errno;
+	const std::int64_t store = !live ? entry.store
+		: S_ISREG(st.st_mode) ? snapshots.storeOf(st.st_ino, false) : 0;
+	if (store)
+		info->snapshot_store.open(store, false);
+	info->snapshot_generation = point.generation;
+	info->snapshot_size = snapshot_size(info->snapshot_store, point.generation, st.st_size);
+	
+	fi->fh = reinterpret_cast<int64_t>(info.release());
+	return 0;
+}
+
+static int snapshot_read(cow_file_info *const info, char *buf, size_t size, off_t offset)
+{
+	if (uint64_t(offset) >= info->snapshot_size)
+		return 0;
+	size = std::min<uint64_t>(size, info->snapshot_size-offset);
+	
+	// nothing's been kept of it
+	if (!info->snapshot_store.isOpen())
+	{
+		const ssize_t r = pread(info->fd, buf, size, offset);
+		if (r == -1)
+			return -errno;
+		std::memset(buf+r, 0, size-r);
+		return size;
+	}
+	
+	const off_t startOfRead = offset;
+	std::string data;
+	while (size > 0)
+	{
+		const uint64_t block = (offset >> 12) << 12;
+		const size_t delta = offset-block;
+		const size_t readInBlock = std::min<size_t>(size, 4096-delta);
+		
+		std::memset(buf, 0, readInBlock);
+		if (info->snapshot_store.block(info->snapshot_generation, block, data))
+		{
+			if (data.size() > delta)
+				std::memcpy(buf, data.data()+delta, std::min(readInBlock, data.size()-delta));
+		}
+		else if (pread(info->fd, buf, readInBlock, offset) == -1)
+			return -errno;
+		
+		offset += readInBlock;
+		size -= readInBlock;
+		buf += readInBlock;
+	}
+	return offset - startOfRead;
+}
+
 static int cow_open(const char *path, struct fuse_file_info *fi)
 {
+	if (report_of(path))
+	{
+		if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+			return -EACCES;
+		// it's as long as it is when it's opened, whatever getattr said
+		fi->direct_io = 1;
+		fi->fh = reinterpret_cast<int64_t>(cow_file_info::make(path).release());
+		return 0;
+	}
 	if (is_dotcow(path))
 		return -ENOENT;
+	if (is_snapshots(path))
+	{
+		try
+		{
+			return snapshot_open(path, fi);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+	}
+	// opened for reading too, as what a write replaces is read from it
+	// first, and without O_APPEND, as the kernel says where each write goes
 	int flags = fi->flags;
 	flags &= ~O_WRONLY;
 	flags &= ~O_APPEND;
@@ -547,16 +2934,45 @@ static int cow_open(const char *path, struct fuse_file_info *fi)
 static int cow_release(const char *, struct fuse_file_info *fi)
 {
 	cow_file_info *const info = reinterpret_cast<cow_file_info*>(fi->fh);
+	if (!info->is_new)
+		captures.wait(info->history_node());
 	delete info;
 
 	return 0;
 }
 
+// reads of the backing files that can be done together go through this
+static BlockIO block_io;
+
+// what's read from and written to the working files directly
+static const unsigned pread_metric = Stats::metric("io pread");
+static const unsigned pwrite_metric = Stats::metric("io pwrite");
+
 static int cow_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	cow_file_info *const info = reinterpret_cast<cow_file_info*>(fi->fh);
 	
-	if (is_original(path))
+	if (info->is_report)
+	{
+		if (uint64_t(offset) >= info->report.size())
+			return 0;
+		size = std::min<size_t>(size, info->report.size()-offset);
+		std::memcpy(buf, info->report.data()+offset, size);
+		return size;
+	}
+	if (info->is_snapshot)
+	{
+		try
+		{
+			return snapshot_read(info, buf, size, offset);
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+	}
+	else if (is_original(path))
 	{
 		if (strcmp(path, dotOriginal)==0)
 			path = "/";
@@ -568,66 +2984,124 @@ static int cow_read(const char *path, char *buf, size_t size, off_t offset, stru
 		
 		const off_t startOfRead = offset;
 		
+		// what comes from the working file or from clones is read after
+		// the history has been gone through, all at once
+		struct backing_read
+		{
+			int fd;
+			char *to;
+			size_t length;
+			off_t offset;
+		};
+		std::vector<backing_read> reads;
+		const auto readLater = [&] (int fd, char *to, size_t length, off_t at)
+		{
+			if (!reads.empty() && reads.back().fd == fd
+				&& reads.back().to+reads.back().length == to
+				&& reads.back().offset+off_t(reads.back().length) == at)
+			{
+				reads.back().length += length;
+				return;
+			}
+			backing_read r;
+			r.fd = fd;
+			r.to = to;
+			r.length = length;
+			r.offset = at;
+			reads.push_back(r);
+		};
+		
 		while (size > 0)
 		{
 			const off_t startingBlock = (offset >> 12) << 12;
+			const size_t delta = offset-startingBlock;
 			
 			// startingBlock is a multiple of 4096, conveniently coinciding with historical_filedata
 			
+			size_t readInBlock;
+			bool eof;
+			
 			try
 			{
-				const std::string data = info->filedata().statement("select data from historical_filedata where offset=?")
-					.arg(startingBlock)
-					.execValue<std::string>();
-				
-				// the amount of bytes I got
-				const size_t actuallyRead = data.size();
-				
+				const std::shared_ptr<const historical_block_cache::block> cached
+					= info->cached_extent(startingBlock);
+				if (cached->found)
+				{
+					const historical_extent &extent = cached->extent;
+					if (extent.zeroes || extent.cloned)
+					{
+						// up to the end of this block or the extent
+						const uint64_t end = std::min<uint64_t>(extent.offset+extent.length, startingBlock+4096);
+						readInBlock = std::min<size_t>(size, end > uint64_t(offset) ? end-offset : 0);
+						if (extent.zeroes)
+						{
+							std::memset(buf, 0, readInBlock);
+						}
+						else
+						{
+							readLater(info->clones(), buf, readInBlock, offset);
+						}
+						eof = extent.eof() && end < uint64_t(startingBlock+4096);
+					}
+					else
+					{
+						const size_t actuallyRead = extent.data.size();
+						readInBlock = std::min<size_t>(size, actuallyRead > delta ? actuallyRead-delta : 0);
+						std::memcpy(buf, extent.data.data()+delta, readInBlock);
+						eof = actuallyRead < 4096;
+					}
+				}
+				else
 				{
-					const size_t delta = offset-startingBlock;
-					const size_t readInBlock = std::min<size_t>(size, actuallyRead-delta);
-					std::memcpy(buf, data.data()+delta, readInBlock);
+					// no overlap here, I have to satisfy this block from the real file
+					if (info->fd == -1)
+						return -EIO;
 					
-					offset += readInBlock-delta;
-					size -= readInBlock;
-					buf += readInBlock-delta;
+					// where the working file ends, if it's here, is found out
+					// once it's been read
+					readInBlock = std::min<size_t>(4096-delta, size);
+					readLater(info->fd, buf, readInBlock, offset);
+					eof = false;
 				}
-				
-				if (actuallyRead < 4096)
-					return offset - startOfRead;
-			}
-			catch (no_rows&)
-			{
-				// no overlap here, I have to satisfy this block from the real file
-				if (info->fd == -1)
-					return -EIO;
-
-			
-				// I haven't started on a 4096 block boundary
-				const size_t delta = offset-startingBlock;
-				const ssize_t actuallyRead = pread(info->fd, buf, std::min<size_t>(4096, size), startingBlock+delta);
-				if (actuallyRead == -1)
-					return -errno;
-				
-				const size_t readInBlock = std::min<size_t>(size, actuallyRead-delta);
-				
-				offset += readInBlock-delta;
-				size -= readInBlock;
-				buf += readInBlock-delta;
-				
-				if (actuallyRead < 4096)
-					return offset - startOfRead;
 			}
 			catch (std::exception &e)
 			{
 				std::cerr << "failure: " << e.what() << std::endl;
 				return -EIO;
 			}
+			
+			offset += readInBlock;
+			size -= readInBlock;
+			buf += readInBlock;
+			
+			if (eof)
+				break;
+		}
+		
+		for (const backing_read &r : reads)
+			block_io.read(r.fd, r.to, r.length, r.offset);
+		const std::vector<ssize_t> &results = block_io.run();
+		for (size_t i=0; i < reads.size(); i++)
+		{
+			if (results[i] < 0)
+				return results[i];
+			if (size_t(results[i]) < reads[i].length)
+			{
+				// a clone file has all of what it was given
+				if (reads[i].fd != info->fd)
+					return -EIO;
+				// the working file ends here, and so does the read
+				offset = reads[i].offset + results[i];
+				break;
+			}
 		}
+		
+		read_ahead(info, startOfRead, offset);
 		return offset - startOfRead;
 	}
 	else
 	{
+		const Stats::Timer timer(pread_metric);
 		ssize_t r = pread(info->fd, buf, size, offset);
 		return r;
 	}
@@ -635,7 +3109,7 @@ static int cow_read(const char *path, char *buf, size_t size, off_t offset, stru
 
 static int cow_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	if (is_dotcow(path))
+	if (is_dotcow(path) || is_snapshots(path))
 		return -EACCES;
 	int flags = fi->flags | O_CREAT | O_EXCL;
 	flags &= ~O_WRONLY;
@@ -646,6 +3120,8 @@ static int cow_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	if (fd == -1)
 		return -errno;
 	
+	directory_changed(path);
+	
 	std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
 	
 	fi->fh = reinterpret_cast<int64_t>(info.get());
@@ -653,79 +3129,447 @@ static int cow_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	info->fd = fd;
 	info->is_new = true;
 	info->is_original=false;
-	db.statement("insert into new_files values(?, 'create')").arg(path).exec();
+	db.statement("insert into new_files values(?, 'create')").arg(record(nodes.intern(path))).exec();
+	struct stat st;
+	if ((snapshots.any() || snapshots.anyStores()) && ::fstat(fd, &st) == 0)
+		snapshots.created(path, st.st_ino);
 	info.release();
 	return 0;
 }
 
+// how many blocks mergeData reads at a time
+static const size_t copy_batch = 64;
+
 static void mergeData(
 	cow_file_info *const info,
 	std::vector<bool> &historical_blocks_present,
 	off_t begin, size_t bytes, size_t fsize
 )
 {
-	// it's possible that historical_blocks_present is empty incorrectly
-	std::array<char, 4096> reading;
-	
 	size_t startingBlock = (begin >> 12) << 12;
+	size_t end = std::min<size_t>(begin+bytes, fsize);
+	
+	// if the range reaches the end of the file, then we have to record where the
+	// original ended: the partial last block, or an empty one if there isn't one
+	const bool extending = begin+bytes >= fsize;
+	if (extending)
+	{
+		startingBlock = std::min<size_t>(startingBlock, (fsize >> 12) << 12);
+		end = fsize;
+	}
+	const size_t firstBlock = startingBlock;
+	
+	uint64_t wanted = 0;
+	for (size_t block = startingBlock; block < end; block += 4096)
+		if (!is_present(historical_blocks_present, block))
+			wanted += 4096 + history_budget::row_overhead;
+	if (wanted && !budget.allows(wanted))
+	{
+		// not captured, and not to be by this handle once it's changed
+		mark_present(historical_blocks_present, startingBlock, end-startingBlock);
+		return;
+	}
+	info->changed = true;
+	
+	// the backing file's data region around startingBlock, as told by
+	// SEEK_DATA/SEEK_HOLE; anything before dataStart is a hole
+	off_t dataStart=0, dataEnd=0;
+	
+	// into historical_filedata, now or by way of captures
+	node_id node = 0;
+	const auto keep = [&] (capture &&c)
+	{
+		budget.add(c.data.size() + (c.run < 0 ? -c.run : 0) + history_budget::row_overhead);
+		accounting.preserved(info, c.data.size() + (c.run < 0 ? -c.run : 0));
+		if (!captures.running())
+		{
+			preserve(info->filedata(), c);
+			return;
+		}
+		if (!node)
+			node = info->make_history_node();
+		captures.stage(node, info->oldpath, std::move(c));
+	};
 	
-	size_t lastBlockSize=0;
+	// an extent of zeroes (sign 1) or of cloned data (sign -1)
+	const auto insertRun = [&] (size_t start, size_t length, int sign)
+	{
+		capture c;
+		c.offset = start;
+		c.run = sign*std::int64_t(length);
+		keep(std::move(c));
+	};
 	
-	while (startingBlock < begin+bytes+4096 && startingBlock < fsize)
+	// blocks that are being replaced are read a batch at a time, and then
+	// put into historical_filedata
+	std::vector<capture> copies;
+	const auto flushCopies = [&] ()
 	{
-		// read the data that's being replaced
+		if (copies.empty())
+			return;
+		for (capture &c : copies)
+			block_io.read(info->fd, c.data.data(), c.data.size(), c.offset);
+		const std::vector<ssize_t> &results = block_io.run();
 		
-		if (historical_blocks_present.size() <= startingBlock/4096 || historical_blocks_present[startingBlock/4096])
+		// adjacent blocks that turn out to be all zeroes become one run
+		capture zeroes;
+		for (size_t i=0; i < copies.size(); i++)
 		{
-			const ssize_t r = pread(info->fd, reading.data(), 4096, startingBlock);
-			if (r == -1)
+			capture &c = copies[i];
+			if (results[i] < 0)
+				throw std::runtime_error("failed to read: " + std::to_string(-results[i]));
+			if (size_t(results[i]) != c.data.size())
+				throw std::runtime_error("short read from original file");
+			
+			if (is_zero(reinterpret_cast<const char*>(c.data.data()), c.data.size()))
+			{
+				if (zeroes.run && zeroes.offset+zeroes.run == c.offset)
+				{
+					zeroes.run += c.data.size();
+					continue;
+				}
+				if (zeroes.run)
+					keep(std::move(zeroes));
+				zeroes = capture();
+				zeroes.offset = c.offset;
+				zeroes.run = c.data.size();
+				continue;
+			}
+			if (zeroes.run)
 			{
-				throw std::runtime_error("failed to read: " + std::to_string(errno));
+				keep(std::move(zeroes));
+				zeroes = capture();
 			}
+			keep(std::move(c));
+		}
+		if (zeroes.run)
+			keep(std::move(zeroes));
+		copies.clear();
+	};
+	const auto copyBlock = [&] (size_t block, size_t length)
+	{
+		capture c;
+		c.offset = block;
+		c.data.resize(length);
+		copies.push_back(std::move(c));
+		if (copies.size() == copy_batch)
+			flushCopies();
+	};
+	
+	// a run of blocks that has yet to be put into historical_filedata
+	enum { no_run, zero_run, clone_run } runKind = no_run;
+	size_t runStart=0, runLength=0;
+	const auto flushRun = [&] ()
+	{
+		if (runKind == zero_run)
+		{
+			insertRun(runStart, runLength, 1);
+		}
+		else if (runKind == clone_run)
+		{
+			// only whole blocks can be cloned, the last partial one gets copied
+			const size_t cloneLength = runLength & ~size_t(4095);
+			const size_t cloneEnd = runStart+cloneLength;
 			
-			lastBlockSize = r;
+			const auto copyBlocks = [&] (size_t from, size_t to)
+			{
+				for (size_t b = from; b < to; b += 4096)
+					copyBlock(b, 4096);
+			};
 			
-			// and put what's being replaced into the historical data
-			info->filedata().statement("insert or ignore into historical_filedata values(?,?)")
-				.arg(startingBlock)
-				.argBlob(reinterpret_cast<unsigned char*>(reading.data()), r)
-				.exec();
-
-			if (historical_blocks_present.size() > startingBlock/4096)
-				historical_blocks_present[startingBlock/4096]=true;
+			// blocks are only cloned into holes of the clone file: another
+			// handle of the file, whose blocks this one doesn't know are
+			// preserved, may have cloned some of them already, and what it
+			// cloned is what the history has. Those are copied instead, which
+			// only counts if they turn out not to be in the history after all
+			size_t at = runStart;
+			while (at < cloneEnd)
+			{
+				off_t cloned = ::lseek(info->clones(), at, SEEK_DATA);
+				if (cloned == -1 && errno == ENXIO)
+					cloned = cloneEnd;
+				else if (cloned == -1)
+				{
+					// can't tell, so nothing is cloned
+					copyBlocks(at, cloneEnd);
+					break;
+				}
+				const size_t holeEnd = std::min<size_t>(cloned & ~off_t(4095), cloneEnd);
+				if (holeEnd > at)
+				{
+					file_clone_range range;
+					range.src_fd = info->fd;
+					range.src_offset = at;
+					range.src_length = holeEnd-at;
+					range.dest_offset = at;
+					if (::ioctl(info->clones(), FICLONERANGE, &range) == 0)
+						insertRun(at, holeEnd-at, -1);
+					else
+						copyBlocks(at, holeEnd);
+				}
+				if (holeEnd == cloneEnd)
+					break;
+				
+				off_t hole = ::lseek(info->clones(), holeEnd, SEEK_HOLE);
+				const size_t dataEnd = hole == -1 ? cloneEnd
+					: std::min<size_t>((size_t(hole)+4095) & ~size_t(4095), cloneEnd);
+				copyBlocks(holeEnd, dataEnd);
+				at = dataEnd;
+			}
+			if (cloneLength != runLength)
+				copyBlock(runStart+cloneLength, runLength-cloneLength);
+		}
+		runKind = no_run;
+		runLength = 0;
+	};
+	
+	while (startingBlock < end)
+	{
+		const size_t blockLength = std::min<size_t>(4096, fsize-startingBlock);
+		
+		if (is_present(historical_blocks_present, startingBlock))
+		{
+			flushRun();
+			accounting.skipped(info, 1);
+			startingBlock += 4096;
+			continue;
+		}
+		
+		if (off_t(startingBlock) >= dataEnd)
+		{
+			dataStart = lseek(info->fd, startingBlock, SEEK_DATA);
+			if (dataStart == -1 && errno == ENXIO)
+			{
+				// nothing but a hole to the end of the file
+				dataStart = dataEnd = fsize;
+			}
+			else if (dataStart == -1)
+			{
+				// the filesystem can't tell us, so assume it's all data
+				dataStart = startingBlock;
+				dataEnd = fsize;
+			}
+			else
+			{
+				dataEnd = lseek(info->fd, dataStart, SEEK_HOLE);
+				if (dataEnd == -1)
+					dataEnd = fsize;
+			}
+		}
+		
+		if (off_t(startingBlock+blockLength) <= dataStart)
+		{
+			// a hole, so we don't even have to read it
+			if (runKind != zero_run)
+			{
+				flushRun();
+				runKind = zero_run;
+				runStart = startingBlock;
+			}
+			runLength += blockLength;
+		}
+		else if (reflink_capture)
+		{
+			// cloning costs no data I/O, so don't even look for zeroes
+			if (runKind != clone_run)
+			{
+				flushRun();
+				runKind = clone_run;
+				runStart = startingBlock;
+			}
+			runLength += blockLength;
 		}
 		else
-			lastBlockSize = 4096;
-			
+		{
+			flushRun();
+			copyBlock(startingBlock, blockLength);
+		}
+		mark_present(historical_blocks_present, startingBlock, blockLength);
+		
 		startingBlock += 4096;
 	}
+	flushRun();
+	flushCopies();
 	
-	if (lastBlockSize == 4096 && historical_blocks_present.size() >= startingBlock/4096)
+	if (extending && fsize%4096 == 0 && !is_present(historical_blocks_present, fsize))
 	{
 		// one more empty block to indicate EOF
-		historical_blocks_present[startingBlock/4096]=true;
-		info->filedata().statement("insert or ignore into historical_filedata values(?,?)")
-			.arg(startingBlock)
-			.argBlob("")
-			.exec();
+		mark_present(historical_blocks_present, fsize, 0);
+		capture c;
+		c.offset = fsize;
+		keep(std::move(c));
+	}
+	
+	block_cache.invalidate(info->history_node(), firstBlock, extending ? fsize+4096 : end);
+	
+	// what's been staged has to be on disk before what replaces it can be
+	captures.sync();
+}
+
+// what snapshotData is given to say everything from 'begin' on
+static const uint64_t to_end = ~uint64_t(0);
+
+// the working file's blocks from 'begin', for 'bytes', are about to change
+// or go, as may its size. The snapshots taken since they last changed see
+// them as they are now, so the first time in a generation that a block
+// changes, it's kept in the file's store first, as is the file's size.
+static void snapshotData(cow_file_info *const info, uint64_t begin, uint64_t bytes)
+{
+	if (!snapshots.any())
+		return;
+	const std::int64_t generation = snapshots.generation();
+	
+	if (info->kept_generation != generation)
+	{
+		struct stat st;
+		if (::fstat(info->fd, &st) == -1)
+			throw std::runtime_error("failed to stat: " + std::to_string(errno));
+		
+		// no snapshot has a file that's been created since the last one
+		if (!S_ISREG(st.st_mode) || snapshots.createdNow(st.st_ino))
+		{
+			info->keeps_nothing = true;
+			info->kept_generation = generation;
+			return;
+		}
+		
+		if (!info->snapshot_store.isOpen())
+			info->snapshot_store.open(snapshots.storeOf(st.st_ino, true), true);
+		bool hasSize;
+		std::vector<bool> kept;
+		for (const uint64_t offset : info->snapshot_store.kept(generation, hasSize))
+			mark_present(kept, offset, 4096);
+		uint64_t size = st.st_size;
+		if (hasSize)
+			info->snapshot_store.size(generation, size);
+		else
+			info->snapshot_store.keepSize(generation, size);
+		
+		info->keeps_nothing = false;
+		info->kept_blocks.swap(kept);
+		info->kept_size = size;
+		info->kept_generation = generation;
+	}
+	if (info->keeps_nothing || begin >= info->kept_size)
+		return;
+	
+	// what's past where it ended wasn't there to see
+	const uint64_t end = begin + std::min(bytes, info->kept_size-begin);
+	std::vector<uint64_t> wanted;
+	for (uint64_t block = (begin >> 12) << 12; block < end; block += 4096)
+		if (!is_present(info->kept_blocks, block))
+			wanted.push_back(block);
+	if (wanted.empty())
+		return;
+	if (!budget.allows(wanted.size()*(4096 + history_budget::row_overhead)))
+	{
+		for (const uint64_t block : wanted)
+			mark_present(info->kept_blocks, block, 4096);
+		return;
+	}
+	
+	SnapshotStore &store = info->snapshot_store;
+	std::vector<char> buffer(std::min(wanted.size(), copy_batch)*4096);
+	store.begin();
+	try
+	{
+		for (size_t first = 0; first < wanted.size(); first += copy_batch)
+		{
+			const size_t count = std::min(copy_batch, wanted.size()-first);
+			for (size_t i=0; i < count; i++)
+				block_io.read(info->fd, &buffer[i*4096], 4096, wanted[first+i]);
+			const std::vector<ssize_t> &results = block_io.run();
+			for (size_t i=0; i < count; i++)
+			{
+				if (results[i] < 0)
+					throw std::runtime_error("failed to read: " + std::to_string(-results[i]));
+				store.keep(generation, wanted[first+i], &buffer[i*4096], results[i]);
+				budget.add(results[i] + history_budget::row_overhead);
+			}
+		}
+		store.commit();
+	}
+	catch (...)
+	{
+		store.rollback();
+		throw;
+	}
+	
+	for (const uint64_t block : wanted)
+		mark_present(info->kept_blocks, block, 4096);
+}
+
+// what's at 'path' is about to be removed or replaced. If a snapshot may
+// have it, it's moved into its store rather than removed, and the store
+// is returned.
+static std::int64_t snapshot_erase(const char *path)
+{
+	if (!snapshots.any())
+		return 0;
+	struct stat st;
+	if (::fstatat(origin_fd, atdir(path), &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return 0;
+	if (S_ISDIR(st.st_mode))
+	{
+		snapshots.removedDir(path, serialize_stat(st));
+		return 0;
+	}
+	
+	std::int64_t store = 0;
+	if (!snapshots.createdNow(st.st_ino))
+	{
+		store = snapshots.detach(st.st_ino);
+		const std::string file = Snapshots::storeFile(store);
+		if (::renameat(origin_fd, atdir(path), origin_fd, file.c_str()) == -1)
+			throw std::runtime_error("failed to move " + std::string(path) + " to " + file);
+		budget.add(std::int64_t(st.st_blocks)*512);
+	}
+	snapshots.erased(path, store, serialize_stat(st));
+	return store;
+}
+
+// mkdir /.snapshots/<name>
+static int snapshot_take(const char *path)
+{
+	std::string name, rest;
+	if (!snapshot_path(path, name, rest) || rest != "/")
+		return -EACCES;
+	
+	tx tx(db);
+	try
+	{
+		if (snapshots.take(name))
+			return 0;
+		tx.rollback();
+		return -EEXIST;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		tx.rollback();
+		return -EIO;
 	}
-	
 }
 
 static int cow_mkdir(const char *path, mode_t mode)
 {
 	if (is_dotcow(path))
 		return -EACCES;
+	if (is_snapshots(path))
+		return snapshot_take(path);
 	struct stat buf;
 	if (::fstatat(origin_fd, atdir(path), &buf, 0) == 0)
 	{
 		return -EEXIST;
 	}
 	
+	directory_changed(path);
+	
 	tx tx(db);
 	try
 	{
-		db.statement("insert into new_files values(?, 'mkdir')").arg(path).exec();
+		db.statement("insert into new_files values(?, 'mkdir')").arg(record(nodes.intern(path))).exec();
+		snapshots.created(path, 0);
 		
 		int r = ::mkdirat(origin_fd, atdir(path), mode);
 		if (r == 0)
@@ -745,27 +3589,32 @@ static int cow_rmdir(const char *path)
 {
 	if (is_dotcow(path))
 		return -ENOENT;
+	if (is_snapshots(path))
+		return -EACCES;
 	struct stat buf;
-	if (::fstatat(origin_fd, atdir(path), &buf, 0) == 0)
-		return -EEXIST;
+	if (::fstatat(origin_fd, atdir(path), &buf, 0) == -1)
+		return -errno;
+	
+	directory_changed(path);
 	
 	tx tx(db);
 	try
 	{
 		// is this a new dir?
-		
-		unsigned c = db.statement("select count(*) from new_files where path=?").arg(path).execValue<unsigned>();
-		if (c == 0)
+		if (!is_new_path(path))
 		{
-			// path is historic, I have to mark it as erased
-			
-			db.statement("insert into historical_files values(?, 'rmdir', ?)").arg(path).argBlob(serialize_stat(buf)).exec();
+			// path is historic, I have to mark it as erased, under its original
+			// path, which replaces its rename if it had one
+			record(nodes.find(path));
+			db.statement("insert or replace into historical_files values(?, 'rmdir', ?)")
+				.arg(record(nodes.intern(original_path(path)))).argBlob(serialize_stat(buf)).exec();
 		}
 		else
 		{
-			db.statement("delete from new_files where path=?").arg(path).exec();
+			db.statement("delete from new_files where node=?").arg(record(nodes.find(path))).exec();
 		}
 		
+		snapshot_erase(path);
 		int r = ::unlinkat(origin_fd, atdir(path), AT_REMOVEDIR);
 		if (r == 0)
 			return 0;
@@ -781,10 +3630,27 @@ static int cow_rmdir(const char *path)
 }
 
 
+// see cow_file_info::prepare_history
+static int prepare_history(cow_file_info *info)
+{
+	try
+	{
+		info->prepare_history();
+		return 0;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		return -EIO;
+	}
+}
+
 static int cow_unlink(const char *path)
 {
 	if (is_dotcow(path))
 		return -ENOENT;
+	if (is_snapshots(path))
+		return -EACCES;
 	struct stat buf;
 	if (::fstatat(origin_fd, atdir(path), &buf, 0) == -1)
 	{
@@ -792,15 +3658,22 @@ static int cow_unlink(const char *path)
 	}
 	
 	std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
+	if (const int r = prepare_history(info.get()))
+		return r;
 
+	directory_changed(path);
+	
+	budget.makeRoom();
 	tx tx(db);
 	try
 	{
 		// does 'path' exist right now and is it historic?
-		unsigned c = db.statement("select count(*) from new_files where path=?").arg(path).execValue<unsigned>();
-		if (c == 0)
+		if (!info->is_new)
 		{
-			// path is historic, I have to mark it as erased
+			// path is historic, I have to mark it as erased, under its original
+			// path, which replaces its rename if it had one
+			const node_id node = record(info->make_history_node());
+			record(nodes.find(path));
 			if (S_ISLNK(buf.st_mode))
 			{
 				struct stat sb;
@@ -812,12 +3685,15 @@ static int cow_unlink(const char *path)
 				int rc = ::readlink(path, &linkname[0], linkname.length());
 				if (rc == -1)
 					return -errno;
-				db.statement("insert into historical_files values(?, 'erased_link', ?)").arg(path).arg(linkname).exec();
+				db.statement("insert or replace into historical_files values(?, 'erased_link', ?)").arg(node).arg(linkname).exec();
 			}
 			else
 			{
-				db.statement("insert into historical_files values(?, 'erased', ?)")
-					.arg(path).argBlob(serialize_stat(buf)).exec();
+				struct stat original = buf;
+				if (info->original_file_size != -1)
+					original.st_size = info->original_file_size;
+				db.statement("insert or replace into historical_files values(?, 'erased', ?)")
+					.arg(node).argBlob(serialize_stat(original)).exec();
 			}
 			
 			// and save its data
@@ -826,23 +3702,28 @@ static int cow_unlink(const char *path)
 			if (info->fd == -1)
 				return -EIO;
 			
-			{
-				// this can be empty
-				std::vector<bool> historical_blocks_present;
-				mergeData(info.get(), historical_blocks_present, 0, buf.st_size, buf.st_size);
-			}
+			if (info->original_file_size != -1)
+				mergeData(info.get(), info->historical_blocks_present,
+					0, info->original_file_size, info->original_file_size);
 		}
 		else
 		{ // path is not historic, I can just forget about it
-			db.statement("delete from new_files where path=?").arg(path).exec();
+			db.statement("delete from new_files where node=?").arg(record(nodes.find(path))).exec();
 		}
 		
+		if (snapshot_erase(path))
+			return 0;
 		int r = ::unlinkat(origin_fd, atdir(path), 0);
 		if (r == 0)
 			return 0;
 		tx.rollback();
 		return -errno;
 	}
+	catch (history_full &)
+	{
+		tx.rollback();
+		return -ENOSPC;
+	}
 	catch (std::exception &e)
 	{
 		std::cerr << "error: " << e.what() << std::endl;
@@ -853,7 +3734,31 @@ static int cow_unlink(const char *path)
 
 static int cow_readlink(const char *path, char *buf, size_t bufsize)
 {
-	if (is_original(path))
+	if (is_snapshots(path))
+	{
+		try
+		{
+			Snapshots::Point point;
+			Snapshots::Entry entry;
+			if (!find_snapshot(path, point, entry))
+				return -ENOENT;
+			if (entry.kind == Snapshots::Entry::RemovedDir)
+				return -EINVAL;
+			const std::string file = entry.kind == Snapshots::Entry::Live
+				? atdir(entry.path.c_str()) : Snapshots::storeFile(entry.store);
+			const ssize_t r = readlinkat(origin_fd, file.c_str(), buf, bufsize-1);
+			if (r == -1)
+				return -errno;
+			buf[r] = '\0';
+			return 0;
+		}
+		catch (std::exception &e)
+		{
+			std::cerr << "error: " << e.what() << std::endl;
+			return -EIO;
+		}
+	}
+	else if (is_original(path))
 	{
 		if (strcmp(path, dotOriginal)==0)
 			path = "/";
@@ -866,8 +3771,8 @@ static int cow_readlink(const char *path, char *buf, size_t bufsize)
 		try
 		{
 			std::string linkpath
-				= db.statement("select linkpath, from historical_files where path=? and command='erased_link'")
-					.arg(path)
+				= db.statement("select data from historical_files where node=? and command='erased_link'")
+					.arg(nodes.find(path))
 					.execValue<std::string>();
 			
 			std::memcpy(buf, linkpath.c_str(), std::min(bufsize, linkpath.length()+1));
@@ -892,14 +3797,17 @@ static int cow_symlink(const char *oldpath, const char *newpath)
 {
 	if (is_dotcow(oldpath))
 		return -ENOENT;
-	if (is_dotcow(newpath))
+	if (is_dotcow(newpath) || is_snapshots(newpath))
 		return -EACCES;
 
+	directory_changed(newpath);
+	
 	tx tx(db);
 	
 	try
 	{
-		db.statement("insert into new_files values(?, 'symlink')").arg(newpath).arg(oldpath).exec();
+		db.statement("insert into new_files values(?, 'symlink')").arg(record(nodes.intern(newpath))).exec();
+		snapshots.created(newpath, 0);
 	}
 	catch (std::exception &e)
 	{
@@ -908,7 +3816,7 @@ static int cow_symlink(const char *oldpath, const char *newpath)
 		return -EIO;
 	}
 	
-	int rc = symlink(oldpath, newpath);
+	int rc = ::symlinkat(oldpath, origin_fd, atdir(newpath));
 	if (rc == -1)
 	{
 		tx.rollback();
@@ -917,11 +3825,46 @@ static int cow_symlink(const char *oldpath, const char *newpath)
 	return 0;
 }
 
+// the directory 'from' was renamed to 'to'; what's in it keeps its history
+// by way of the directory's own rename, but the new files in it and what
+// was renamed into it are known by their path in the working tree, and
+// move with it. Only those are visited, not everything in the directory.
+static void move_descendants(const std::string &from, const std::string &to)
+{
+	const node_id dir = nodes.find(from);
+	if (!dir)
+		return;
+	
+	std::vector<node_id> moved;
+	db
+		.statement("with recursive under(id) as ("
+				"select id from nodes where parent=? "
+				"union all select nodes.id from nodes join under on nodes.parent=under.id"
+			") select id from under "
+			"where id in (select node from new_files) "
+			"or id in (select data from historical_files where command='rename')")
+		.arg(dir)
+		.exec(Args<std::uint64_t>(), [&] (const std::tuple<std::uint64_t> &id)
+		{
+			moved.push_back(std::get<0>(id));
+		});
+	
+	for (const node_id id : moved)
+	{
+		const node_id now = record(nodes.intern(to + nodes.path(id).substr(from.size())));
+		record(id);
+		record(renamed_from(id));
+		db.statement("update new_files set node=? where node=?").arg(now).arg(id).exec();
+		db.statement("update historical_files set data=? where data=? and command='rename'")
+			.arg(now).arg(id).exec();
+	}
+}
+
 static int cow_rename(const char *path, const char *newpath)
 {
 	if (is_dotcow(path))
 		return -ENOENT;
-	if (is_dotcow(newpath))
+	if (is_dotcow(newpath) || is_snapshots(path) || is_snapshots(newpath))
 		return -EACCES;
 	struct stat buf;
 	if (::fstatat(origin_fd, atdir(path), &buf, 0) == -1)
@@ -929,50 +3872,64 @@ static int cow_rename(const char *path, const char *newpath)
 		return -errno;
 	}
 	
+	directory_changed(path);
+	directory_changed(newpath);
+	
+	budget.makeRoom();
 	tx tx(db);
 	
 	try
 	{
 		// does 'path' exist right now and is it historic?
-		unsigned c = db.statement("select count(*) from new_files where path=?").arg(path).execValue<unsigned>();
-		if (c == 0)
+		if (!is_new_path(path))
 		{
-			// path is historic, I have to mark it as renamed
+			// whatever was renamed to path isn't anymore
+			record(nodes.find(path));
 			
-			try
-			{
-				std::string oldpath = db.statement("select path from historical_files where command='rename' and data=?")
-					.arg(path)
-					.execValue<std::string>();
-				if (oldpath == newpath)
-				{
-					// if newpath is the oldpath, then it's been un-renamed
-					db.statement("delete from historical_files where path=? and command='rename'").arg(oldpath).exec();
-				}
-				else
-				{
-					// it has been renamed, and it's been renamed again
-					db.statement("update historical_files set data=? where path=? and command='rename'")
-						.arg(newpath)
-						.arg(oldpath).exec();
-				
-				}
-			}
-			catch (no_rows&)
-			{
-				db.statement("insert or ignore into historical_files values(?, 'rename', ?)").arg(path).arg(newpath).exec();
-			}
+			// path is historic, I have to mark it as renamed: its original
+			// path now maps to newpath, unless that's where its parent's
+			// mapping would put it anyway (such as when it's un-renamed)
+			const std::string original = original_path(path);
+			const node_id node = record(nodes.intern(original));
+			const std::string parent = working_path(parent_directory(original));
+			const std::string byParent = (parent == "/" ? "" : parent)
+				+ original.substr(original.rfind('/'));
+			
+			if (byParent == newpath)
+				db.statement("delete from historical_files where node=? and command='rename'").arg(node).exec();
+			else
+				db.statement("insert or replace into historical_files values(?, 'rename', ?)")
+					.arg(node)
+					.arg(record(nodes.intern(newpath))).exec();
 		}
 		else
 		{ // path is not historic, I have to rename it
-			db.statement("update new_files set path=? where path=?").arg(path).arg(newpath).exec();
+			db.statement("update new_files set node=? where node=?")
+				.arg(record(nodes.intern(newpath)))
+				.arg(record(nodes.find(path))).exec();
 		}
 		
+		if (S_ISDIR(buf.st_mode))
+			move_descendants(path, newpath);
+		
+		// what it replaces is erased, as far as the snapshots are concerned
+		std::int64_t replaced = 0;
+		struct stat from, to;
+		if (snapshots.any()
+			&& ::fstatat(origin_fd, atdir(path), &from, AT_SYMLINK_NOFOLLOW) == 0
+			&& ::fstatat(origin_fd, atdir(newpath), &to, AT_SYMLINK_NOFOLLOW) == 0
+			&& from.st_ino != to.st_ino && S_ISDIR(from.st_mode) == S_ISDIR(to.st_mode))
+			replaced = snapshot_erase(newpath);
+		snapshots.renamed(path, newpath);
+		
 		int r = ::renameat(origin_fd, atdir(path), origin_fd, atdir(newpath));
 		if (r == -1)
 		{
+			const int e = errno;
+			if (replaced)
+				::renameat(origin_fd, Snapshots::storeFile(replaced).c_str(), origin_fd, atdir(newpath));
 			tx.rollback();
-			return -errno;
+			return -e;
 		}
 		return 0;
 	}
@@ -986,12 +3943,17 @@ static int cow_rename(const char *path, const char *newpath)
 
 static int cow_write(const char *, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	tx tx(db);
-	
 	cow_file_info *const info = reinterpret_cast<cow_file_info*>(fi->fh);
+	if (const int r = prepare_history(info))
+		return r;
+	
+	budget.makeRoom();
+	tx tx(db);
 	
 	try
 	{
+		snapshotData(info, offset, size);
+		
 		if (!info->is_new)
 		{
 			// read all the blocks from "path" that coincide with size and offset
@@ -1002,39 +3964,65 @@ static int cow_write(const char *, const char *buf, size_t size, off_t offset, s
 				offset, size, info->original_file_size);
 		}
 		
-		ssize_t r = pwrite(info->fd, buf, size, offset);
+		ssize_t r;
+		{
+			const Stats::Timer timer(pwrite_metric);
+			r = pwrite(info->fd, buf, size, offset);
+		}
 		if (r == -1)
 		{
+			const int error = errno;
 			tx.rollback();
-			return -errno;
+			info->rolled_back();
+			return -error;
 		}
+		accounting.written(info, r);
 		return r;
 	}
+	catch (history_full &)
+	{
+		tx.rollback();
+		info->rolled_back();
+		return -ENOSPC;
+	}
 	catch (std::exception &e)
 	{
 		std::cerr << "error: " << e.what() << std::endl;
 		tx.rollback();
+		info->rolled_back();
 		return -EIO;
 	}
 }
 
 static int cow_truncate(const char *path, off_t len)
 {
-	tx tx(db);
+	if (is_original(path) || is_snapshots(path) || is_dotcow(path))
+		return -EACCES;
 	
 	std::unique_ptr<cow_file_info> info = cow_file_info::make(path);
 	info->fd = ::openat( origin_fd, atdir(info->newpath.c_str()), O_RDWR);
 	
 	if (info->fd == -1)
 		return -errno;
+	if (const int r = prepare_history(info.get()))
+		return r;
+	
+	budget.makeRoom();
+	tx tx(db);
+	
 	try
 	{
+		snapshotData(info.get(), len, to_end);
+		
 		if (!info->is_new)
 		{
-			const off_t end = lseek(info->fd, 0, SEEK_END);
-			
-			std::vector<bool> historical_blocks_present;
-			mergeData(info.get(), historical_blocks_present, 0, end, end);
+			// only the blocks past the new end are lost (or, when growing,
+			// the original end of file has to be remembered)
+			const size_t fsize = info->original_file_size;
+			if (size_t(len) < fsize)
+				mergeData(info.get(), info->historical_blocks_present, len, fsize-len, fsize);
+			else if (size_t(len) > fsize)
+				mergeData(info.get(), info->historical_blocks_present, fsize, len-fsize, fsize);
 		}
 		
 		int r = ftruncate(info->fd, len);
@@ -1045,6 +4033,11 @@ static int cow_truncate(const char *path, off_t len)
 		}
 		return 0;
 	}
+	catch (history_full &)
+	{
+		tx.rollback();
+		return -ENOSPC;
+	}
 	catch (std::exception &e)
 	{
 		std::cerr << "error: " << e.what() << std::endl;
@@ -1054,9 +4047,100 @@ static int cow_truncate(const char *path, off_t len)
 
 }
 
+static int cow_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	if (is_original(path) || is_snapshots(path))
+		return -EACCES;
+	
+	cow_file_info *const info = reinterpret_cast<cow_file_info*>(fi->fh);
+	if (const int r = prepare_history(info))
+		return r;
+	
+	budget.makeRoom();
+	tx tx(db);
+	
+	try
+	{
+		if (mode & (FALLOC_FL_COLLAPSE_RANGE|FALLOC_FL_INSERT_RANGE))
+			snapshotData(info, offset, to_end);
+		else if (mode & (FALLOC_FL_PUNCH_HOLE|FALLOC_FL_ZERO_RANGE))
+			snapshotData(info, offset, length);
+		else
+			snapshotData(info, offset, 0);
+		
+		if (!info->is_new)
+		{
+			const size_t fsize = info->original_file_size;
+			const bool keepSize = mode & FALLOC_FL_KEEP_SIZE;
+			
+			if (mode & (FALLOC_FL_PUNCH_HOLE|FALLOC_FL_ZERO_RANGE))
+			{
+				// only the original blocks in the range are lost
+				if (size_t(offset) < fsize)
+					mergeData(
+						info, info->historical_blocks_present,
+						offset, std::min<size_t>(length, fsize-offset), fsize
+					);
+			}
+			else if (mode & (FALLOC_FL_COLLAPSE_RANGE|FALLOC_FL_INSERT_RANGE))
+			{
+				// everything after offset moves
+				if (size_t(offset) < fsize)
+					mergeData(info, info->historical_blocks_present, offset, fsize-offset, fsize);
+			}
+			
+			// plain preallocation leaves the data alone, but growing
+			// the file means we have to remember where it used to end
+			if (!keepSize && size_t(offset+length) > fsize)
+				mergeData(info, info->historical_blocks_present, fsize, offset+length-fsize, fsize);
+		}
+		
+		if (::fallocate(info->fd, mode, offset, length) == -1)
+		{
+			const int error = errno;
+			tx.rollback();
+			info->rolled_back();
+			return -error;
+		}
+		return 0;
+	}
+	catch (history_full &)
+	{
+		tx.rollback();
+		info->rolled_back();
+		return -ENOSPC;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		tx.rollback();
+		info->rolled_back();
+		return -EIO;
+	}
+}
+
+// touch, cp -p and the like
+static int cow_utimens(const char *path, const struct timespec tv[2])
+{
+	if (is_dotcow(path) && !report_of(path))
+		return -ENOENT;
+	if (is_original(path) || is_snapshots(path) || is_dotcow(path))
+		return -EACCES;
+	if (::utimensat(origin_fd, atdir(path), tv, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+	return 0;
+}
 
-static int cow_fsync(const char *path, int datasync, struct fuse_file_info *)
+static int cow_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+	if (is_snapshots(path) || is_dotcow(path))
+		return 0;
+	
+	// what the writes replaced has to be in the history before they're on disk
+	cow_file_info *const info = fi ? reinterpret_cast<cow_file_info*>(fi->fh) : nullptr;
+	if (info && !info->is_new && !captures.wait(info->history_node()))
+		return -EIO;
+	
 	int fd = ::openat(origin_fd, atdir(path), O_RDONLY);
 	int rc;
 	if (datasync)
@@ -1070,11 +4154,227 @@ static int cow_fsync(const char *path, int datasync, struct fuse_file_info *)
 	return 0;
 }
 
-static void* cow_init(struct fuse_conn_info *)
+// the backing filesystem, less what .cow takes and what's left of the
+// history budget, which is kept for it
+static int cow_statfs(const char *, struct statvfs *stbuf)
+{
+	if (::fstatvfs(origin_fd, stbuf) == -1)
+		return -errno;
+	const uint64_t unit = stbuf->f_frsize ? stbuf->f_frsize : stbuf->f_bsize;
+	if (unit == 0)
+		return 0;
+	const uint64_t history = (budget.usage()+unit-1)/unit;
+	const uint64_t reserved = budget.reserved()/unit;
+	
+	const auto less = [] (fsblkcnt_t &count, uint64_t by)
+	{
+		count = count > by ? count-by : 0;
+	};
+	less(stbuf->f_blocks, history);
+	less(stbuf->f_bfree, reserved);
+	less(stbuf->f_bavail, reserved);
+	// what's free of what's left
+	stbuf->f_bfree = std::min(stbuf->f_bfree, stbuf->f_blocks);
+	stbuf->f_bavail = std::min(stbuf->f_bavail, stbuf->f_bfree);
+	return 0;
+}
+
+static bool use_io_uring = true;
+
+static void* cow_init(struct fuse_conn_info *conn)
 {
+#ifdef FUSE_CAP_BIG_WRITES
+	conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+	// only now, as fuse may have forked into the background
+	prefetcher.start();
+	captures.start();
+	compactor.start();
+	if (use_io_uring)
+		block_io.open(2*copy_batch);
 	return nullptr;
 }
 
+// The history index is trusted only while the database has the stamp it
+// was written with. The stamp is taken away for as long as the filesystem
+// is mounted, so after a crash the next mount writes the index again.
+static std::uint64_t history_index_stamp = 0;
+
+static void open_history_index()
+{
+	db.exec("create table if not exists history_index (stamp integer)");
+	try
+	{
+		std::uint64_t stamp = 0;
+		try
+		{
+			stamp = db.statement("select stamp from history_index").execValue<std::uint64_t>();
+		}
+		catch (no_rows&)
+		{
+		}
+		
+		if (!history_index.open(origin_fd, historyIndexPath, stamp))
+		{
+			stamp = std::chrono::system_clock::now().time_since_epoch().count() | 1;
+			HistoryIndex::write(db, origin_fd, historyIndexPath, stamp);
+			if (!history_index.open(origin_fd, historyIndexPath, stamp))
+				throw std::runtime_error(std::string("failed to map ") + historyIndexPath);
+		}
+		history_index_stamp = stamp;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: history index not used: " << e.what() << std::endl;
+	}
+	db.exec("delete from history_index");
+}
+
+static void close_history_index()
+{
+	try
+	{
+		std::uint64_t stamp = history_index_stamp;
+		if (stamp == 0 || history_index.anyChanges())
+		{
+			stamp = std::chrono::system_clock::now().time_since_epoch().count() | 1;
+			HistoryIndex::write(db, origin_fd, historyIndexPath, stamp);
+		}
+		history_index.close();
+		db.statement("insert into history_index values(?)").arg(stamp).exec();
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: failed to write the history index: " << e.what() << std::endl;
+	}
+}
+
+static void cow_destroy(void *)
+{
+	compactor.stop();
+	captures.stop();
+	prefetcher.stop();
+	close_history_index();
+	budget.save();
+	std::cerr << "block cache: " << block_cache.hits() << " hits, "
+		<< block_cache.misses() << " misses" << std::endl;
+	if (compactor.reclaimed())
+		std::cerr << "compaction: " << compactor.reclaimed() << " bytes reclaimed" << std::endl;
+}
+
+// everything with history gets compacted once, and clone files left by
+// a crash before what was cloned got into the history go
+static void request_compaction()
+{
+	const std::string filedataDir = std::string(dotCow+1) + "/filedata";
+	const std::string clonesDir = std::string(dotCow+1) + "/clones";
+	
+	const int dfd = ::openat(origin_fd, filedataDir.c_str(), O_DIRECTORY|O_CLOEXEC);
+	if (DIR *const d = dfd == -1 ? nullptr : fdopendir(dfd))
+	{
+		while (const dirent *const entry = readdir(d))
+		{
+			char *end;
+			const node_id node = std::strtoll(entry->d_name, &end, 10);
+			if (*end != '\0' || node == 0)
+				continue;
+			
+			std::string command;
+			db.statement("select command from historical_files where node=?")
+				.arg(node)
+				.exec(Args<std::string>(), [&] (const std::tuple<std::string> &row)
+				{
+					command = std::get<0>(row);
+				});
+			if (command == "erased" || command == "erased_link" || command == "rmdir")
+				continue;
+			
+			// as cow_file_info would find it
+			const std::string original = nodes.path(node);
+			const std::string working = working_path(original);
+			if (working == original && (original_path(working) != working || is_new_path(working)))
+				continue;
+			struct stat st;
+			if (::fstatat(origin_fd, atdir(working.c_str()), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode))
+				compactor.request(node, working, st);
+		}
+		closedir(d);
+	}
+	
+	const int cfd = ::openat(origin_fd, clonesDir.c_str(), O_DIRECTORY|O_CLOEXEC);
+	if (DIR *const d = cfd == -1 ? nullptr : fdopendir(cfd))
+	{
+		while (const dirent *const entry = readdir(d))
+		{
+			if (entry->d_name[0] == '.')
+				continue;
+			if (::faccessat(origin_fd, (filedataDir + "/" + entry->d_name).c_str(), F_OK, 0) == -1)
+				::unlinkat(origin_fd, (clonesDir + "/" + entry->d_name).c_str(), 0);
+		}
+		closedir(d);
+	}
+}
+
+
+// see if the backing filesystem can clone extents between files in .cow
+static bool probe_reflink()
+{
+	const std::string a = std::string(dotCow+1) + "/probe-a";
+	const std::string b = std::string(dotCow+1) + "/probe-b";
+	
+	bool works = false;
+	const int afd = ::openat(origin_fd, a.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+	const int bfd = ::openat(origin_fd, b.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (afd != -1 && bfd != -1)
+	{
+		std::array<char, 4096> block;
+		block.fill('x');
+		if (::pwrite(afd, block.data(), block.size(), 0) == ssize_t(block.size()))
+		{
+			file_clone_range range;
+			range.src_fd = afd;
+			range.src_offset = 0;
+			range.src_length = block.size();
+			range.dest_offset = 0;
+			works = ::ioctl(bfd, FICLONERANGE, &range) == 0;
+		}
+	}
+	if (afd != -1)
+		::close(afd);
+	if (bfd != -1)
+		::close(bfd);
+	::unlinkat(origin_fd, a.c_str(), 0);
+	::unlinkat(origin_fd, b.c_str(), 0);
+	return works;
+}
+
+// each operation is timed as "fuse <name>" (see stats.h)
+template<typename Handler, Handler handler>
+struct timed;
+
+template<typename R, typename ...Args, R (*handler)(Args...)>
+struct timed<R (*)(Args...), handler>
+{
+	static unsigned metric;
+	
+	static R call(Args ...args)
+	{
+		const Stats::Timer timer(metric);
+		return handler(args...);
+	}
+};
+
+template<typename R, typename ...Args, R (*handler)(Args...)>
+unsigned timed<R (*)(Args...), handler>::metric;
+
+template<typename Handler, Handler handler>
+static Handler timed_op(const char *name)
+{
+	timed<Handler, handler>::metric = Stats::metric(std::string("fuse ") + name);
+	return &timed<Handler, handler>::call;
+}
+
+#define TIMED(op) timed_op<decltype(&cow_##op), &cow_##op>(#op)
 
 /*
 create a file: path, 'create', mode
@@ -1088,33 +4388,88 @@ int main(int argc, char *argv[])
 {
 	struct fuse_operations cow_oper;
 	std::memset(&cow_oper, 0, sizeof(cow_oper));
-	cow_oper.getattr = cow_getattr;
-	cow_oper.open = cow_open;
-	cow_oper.release = cow_release;
-	cow_oper.read = cow_read;
-	cow_oper.write = cow_write;
+	cow_oper.getattr = TIMED(getattr);
+	cow_oper.open = TIMED(open);
+	cow_oper.release = TIMED(release);
+	cow_oper.read = TIMED(read);
+	cow_oper.write = TIMED(write);
 	cow_oper.init = cow_init;
-	cow_oper.opendir = cow_opendir;
-	cow_oper.readdir = cow_readdir;
-	cow_oper.releasedir = cow_releasedir;
-	cow_oper.unlink = cow_unlink;
-	cow_oper.mkdir = cow_mkdir;
-	cow_oper.rmdir = cow_rmdir;
-	cow_oper.create = cow_create;
-	cow_oper.rename = cow_rename;
-	cow_oper.truncate = cow_truncate;
-	cow_oper.fsync = cow_fsync;
-	cow_oper.symlink = cow_symlink;
-	cow_oper.readlink = cow_readlink;
+	cow_oper.destroy = cow_destroy;
+	cow_oper.opendir = TIMED(opendir);
+	cow_oper.readdir = TIMED(readdir);
+	cow_oper.releasedir = TIMED(releasedir);
+	cow_oper.unlink = TIMED(unlink);
+	cow_oper.mkdir = TIMED(mkdir);
+	cow_oper.rmdir = TIMED(rmdir);
+	cow_oper.create = TIMED(create);
+	cow_oper.rename = TIMED(rename);
+	cow_oper.truncate = TIMED(truncate);
+	cow_oper.fsync = TIMED(fsync);
+	cow_oper.statfs = TIMED(statfs);
+	cow_oper.utimens = TIMED(utimens);
+	cow_oper.fallocate = TIMED(fallocate);
+	cow_oper.symlink = TIMED(symlink);
+	cow_oper.readlink = TIMED(readlink);
 
 	std::vector<char*> more_argv;
 	more_argv.push_back(argv[0]);
 	bool has=false;
 	bool second=false;
 	int origin_index=-1;
+	size_t block_cache_size = default_block_cache_size;
+	size_t capture_buffer_size = default_capture_buffer_size;
+	uint64_t compact_rate = default_compact_rate;
+	// in megabytes, or a percentage of the backing filesystem if budget_percent
+	uint64_t history_limit = 0;
+	bool budget_percent = false;
+	bool timing = true;
 	for (int i=1; i < argc; i++)
 	{
-		if (argv[i][0] == '-')
+		if (std::strncmp(argv[i], "--block-cache=", 14) == 0)
+		{
+			// in megabytes
+			block_cache_size = std::strtoull(argv[i]+14, nullptr, 10)*1024*1024;
+		}
+		else if (std::strncmp(argv[i], "--capture-buffer=", 17) == 0)
+		{
+			// in megabytes
+			capture_buffer_size = std::strtoull(argv[i]+17, nullptr, 10)*1024*1024;
+		}
+		else if (std::strncmp(argv[i], "--compact-rate=", 15) == 0)
+		{
+			// in megabytes a second
+			compact_rate = std::strtoull(argv[i]+15, nullptr, 10)*1024*1024;
+		}
+		else if (std::strncmp(argv[i], "--history-budget=", 17) == 0)
+		{
+			char *unit;
+			history_limit = std::strtoull(argv[i]+17, &unit, 10);
+			budget_percent = *unit == '%';
+		}
+		else if (std::strncmp(argv[i], "--over-budget=", 14) == 0)
+		{
+			const std::string policy = argv[i]+14;
+			if (policy == "enospc")
+				budget.setPolicy(history_budget::refuse);
+			else if (policy == "drop-snapshots")
+				budget.setPolicy(history_budget::drop_snapshots);
+			else if (policy == "stop-capturing")
+				budget.setPolicy(history_budget::stop_capturing);
+			else
+			{
+				std::cerr << "--over-budget is one of enospc, drop-snapshots or stop-capturing" << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strcmp(argv[i], "--no-io-uring") == 0)
+		{
+			use_io_uring = false;
+		}
+		else if (std::strcmp(argv[i], "--no-stats") == 0)
+		{
+			timing = false;
+		}
+		else if (argv[i][0] == '-')
 		{
 			more_argv.push_back(argv[i]);
 		}
@@ -1141,20 +4496,56 @@ int main(int argc, char *argv[])
 	if (!second)
 		more_argv.push_back(argv[origin_index]);
 	
+	// for /.cow/stats
+	if (timing)
+		Stats::enable();
+	
 	mkdir( (origin_path + dotCow ).c_str(), 0777 );
 	mkdir( (origin_path + dotCow+ "/filedata").c_str(), 0777 );
+	mkdir( (origin_path + dotCow+ "/clones").c_str(), 0777 );
+	mkdir( (origin_path + dotCow+ "/snapshots").c_str(), 0777 );
 	db.open(origin_path + dotCow+ "/history.db");
 	db.exec("pragma synchronous = NORMAL");
 	
-	db.exec("create table if not exists historical_files (path primary key, command, data)");
-	db.exec("create table if not exists new_files (path primary key, command)");
-	db.exec("create index if not exists historical_renames on historical_files (data,command)");
-
+	
 	origin_fd = ::open(origin_path.c_str(), O_DIRECTORY);
 	if (origin_fd == -1)
 		throw std::runtime_error("failed to open");
 	
+	// paths are interned as nodes, which history refers to by id
+	nodes.open();
+	db.exec("create table if not exists historical_files (node integer primary key, command, data)");
+	db.exec("create table if not exists new_files (node integer primary key, command)");
+	db.exec("create index if not exists historical_renames on historical_files (data,command)");
+	snapshots.open();
+	load_recorded_nodes();
+	open_history_index();
+	block_cache.setCapacity(block_cache_size);
+	captures.setCapacity(capture_buffer_size);
+	compactor.setRate(compact_rate);
+	
 	register_openat_vfs();
 	
+	// before anything can be read from the history it's part of
+	captures.replay();
+	
+	if (compact_rate)
+		request_compaction();
+	
+	if (budget_percent)
+	{
+		struct statvfs fs;
+		if (::fstatvfs(origin_fd, &fs) == -1)
+			throw std::runtime_error("failed to statvfs");
+		history_limit = uint64_t(fs.f_blocks)*fs.f_frsize/100*std::min<uint64_t>(history_limit, 100);
+	}
+	else
+		history_limit *= 1024*1024;
+	budget.setLimit(history_limit);
+	// for statfs, whether or not there's a limit
+	budget.count();
+	
+	reflink_capture = probe_reflink();
+	
 	return fuse_main(more_argv.size(), &more_argv.front(), &cow_oper, nullptr);
 }
@@ -0,0 +1,534 @@
+// Measures cow_fuse on its hot paths: it makes a tree in a temporary
+// directory, mounts it with the cow_fuse it's given, and times each of a
+// series of workloads, one operation at a time, on the mount:
+//   - sequential and random overwrites, and appends, of historical files;
+//   - a storm of small files being created, and then deleted;
+//   - walking (stat'ing everything in) the working tree and .original;
+//   - reading what was overwritten sequentially, through .original;
+//   - truncating and renaming historical files.
+// For each, it prints how many operations a second, the median and 99th
+// percentile latency, and how much the history grew for each byte that
+// was written, as JSON on stdout, so that runs can be compared.
+//
+// Everything it writes comes from a fixed seed, so runs are repeatable.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock clock_type;
+
+static std::string src, mnt;
+static unsigned scale = 1;
+
+static const size_t MB = 1024*1024;
+
+static void check(bool ok, const std::string &what)
+{
+	if (!ok)
+		throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// 'length' bytes that are the same every time for the same 'seed'
+static std::vector<char> pattern(size_t length, unsigned seed)
+{
+	std::mt19937_64 random(seed);
+	std::vector<char> data(length);
+	for (size_t i=0; i < length; i += 8)
+	{
+		const std::uint64_t r = random();
+		std::memcpy(&data[i], &r, std::min<size_t>(8, length-i));
+	}
+	return data;
+}
+
+static void write_file(const std::string &path, size_t length, unsigned seed)
+{
+	const int fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	check(fd != -1, "creating " + path);
+	const std::vector<char> data = pattern(std::min(length, MB), seed);
+	for (size_t done = 0; done < length; )
+	{
+		const ssize_t w = ::write(fd, data.data(), std::min(data.size(), length-done));
+		check(w > 0, "writing " + path);
+		done += w;
+	}
+	::close(fd);
+}
+
+// what's under 'path' takes on disk
+static std::uint64_t disk_usage(const std::string &path)
+{
+	struct stat st;
+	if (::lstat(path.c_str(), &st) == -1)
+		return 0;
+	std::uint64_t bytes = std::uint64_t(st.st_blocks)*512;
+	if (!S_ISDIR(st.st_mode))
+		return bytes;
+	if (DIR *const d = ::opendir(path.c_str()))
+	{
+		while (const dirent *const entry = ::readdir(d))
+		{
+			if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+				bytes += disk_usage(path + "/" + entry->d_name);
+		}
+		::closedir(d);
+	}
+	return bytes;
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *)
+{
+	::remove(path);
+	return 0;
+}
+
+// until what's been written has had what it replaced put into the history:
+// cow_fuse journals what's waiting to be, and empties the journal once
+// nothing is
+static void drain()
+{
+	const std::string journal = src + "/.cow/capture.journal";
+	const clock_type::time_point giveUp = clock_type::now() + std::chrono::seconds(30);
+	struct stat st;
+	while (::stat(journal.c_str(), &st) == 0 && st.st_size != 0)
+	{
+		if (clock_type::now() > giveUp)
+		{
+			std::cerr << "warning: " << journal << " isn't being emptied, "
+				"the history's growth includes what's waiting in it" << std::endl;
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+// what one workload did
+struct result
+{
+	std::string name;
+	std::vector<double> latencies; // in microseconds, one for each operation
+	double seconds=0;
+	std::uint64_t written=0;
+	std::uint64_t history=0;
+};
+
+// times each operation of a workload, and what it all did to the history
+class workload
+{
+	result r;
+	clock_type::time_point started;
+	std::uint64_t historyBefore;
+
+public:
+	explicit workload(const std::string &name)
+	{
+		r.name = name;
+		drain();
+		historyBefore = disk_usage(src + "/.cow");
+		started = clock_type::now();
+	}
+	
+	template<typename Op>
+	void time(const Op &op)
+	{
+		const clock_type::time_point before = clock_type::now();
+		op();
+		r.latencies.push_back(
+			std::chrono::duration<double, std::micro>(clock_type::now() - before).count());
+	}
+	void wrote(std::uint64_t bytes) { r.written += bytes; }
+	
+	result done()
+	{
+		r.seconds = std::chrono::duration<double>(clock_type::now() - started).count();
+		drain();
+		const std::uint64_t after = disk_usage(src + "/.cow");
+		r.history = after > historyBefore ? after-historyBefore : 0;
+		return r;
+	}
+};
+
+// the files that the workloads start with, all of which are historical
+// once it's mounted
+static const char sequentialFile[] = "/sequential";
+static const char randomFile[] = "/random";
+static const char appendFile[] = "/append";
+
+static size_t sequential_size() { return 32*MB*scale; }
+static size_t random_size() { return 32*MB*scale; }
+static unsigned tree_dirs() { return 20*scale; }
+static const unsigned tree_files = 50;
+static unsigned small_files() { return 1000*scale; }
+
+static void populate()
+{
+	write_file(src + sequentialFile, sequential_size(), 1);
+	write_file(src + randomFile, random_size(), 2);
+	write_file(src + appendFile, MB, 3);
+	
+	for (const char *dir : { "/tree", "/truncate", "/rename" })
+		check(::mkdir((src + dir).c_str(), 0755) == 0, "making " + src + dir);
+	for (unsigned d=0; d < tree_dirs(); d++)
+	{
+		const std::string dir = src + "/tree/" + std::to_string(d);
+		check(::mkdir(dir.c_str(), 0755) == 0, "making " + dir);
+		for (unsigned f=0; f < tree_files; f++)
+			write_file(dir + "/" + std::to_string(f), 4096, d*tree_files + f);
+	}
+	for (unsigned f=0; f < small_files(); f++)
+	{
+		write_file(src + "/truncate/" + std::to_string(f), 64*1024, f);
+		write_file(src + "/rename/" + std::to_string(f), 4096, f);
+	}
+}
+
+static result overwrite_sequential()
+{
+	const size_t chunk = 64*1024;
+	const std::vector<char> data = pattern(chunk, 101);
+	const int fd = ::open((mnt + sequentialFile).c_str(), O_WRONLY);
+	check(fd != -1, "opening");
+	
+	workload w("sequential_overwrite");
+	for (size_t offset = 0; offset < sequential_size(); offset += chunk)
+	{
+		w.time([&] { check(::pwrite(fd, data.data(), chunk, offset) == ssize_t(chunk), "writing"); });
+		w.wrote(chunk);
+	}
+	::close(fd);
+	return w.done();
+}
+
+static result overwrite_random()
+{
+	const size_t chunk = 4096;
+	const std::vector<char> data = pattern(chunk, 102);
+	std::mt19937_64 random(102);
+	const int fd = ::open((mnt + randomFile).c_str(), O_WRONLY);
+	check(fd != -1, "opening");
+	
+	workload w("random_overwrite");
+	for (unsigned i=0; i < 4096*scale; i++)
+	{
+		const off_t offset = random() % (random_size()/chunk) * chunk;
+		w.time([&] { check(::pwrite(fd, data.data(), chunk, offset) == ssize_t(chunk), "writing"); });
+		w.wrote(chunk);
+	}
+	::close(fd);
+	return w.done();
+}
+
+static result append()
+{
+	const size_t chunk = 4096;
+	const std::vector<char> data = pattern(chunk, 103);
+	const int fd = ::open((mnt + appendFile).c_str(), O_WRONLY|O_APPEND);
+	check(fd != -1, "opening");
+	
+	workload w("append");
+	for (unsigned i=0; i < 4096*scale; i++)
+	{
+		w.time([&] { check(::write(fd, data.data(), chunk) == ssize_t(chunk), "appending"); });
+		w.wrote(chunk);
+	}
+	::close(fd);
+	return w.done();
+}
+
+static std::vector<result> create_delete()
+{
+	const size_t size = 1024;
+	const std::vector<char> data = pattern(size, 104);
+	const std::string dir = mnt + "/storm";
+	check(::mkdir(dir.c_str(), 0755) == 0, "making " + dir);
+	
+	std::vector<result> results;
+	workload created("create_storm");
+	for (unsigned f=0; f < small_files(); f++)
+	{
+		created.time([&]
+		{
+			const int fd = ::open((dir + "/" + std::to_string(f)).c_str(), O_WRONLY|O_CREAT|O_EXCL, 0644);
+			check(fd != -1, "creating");
+			check(::write(fd, data.data(), size) == ssize_t(size), "writing");
+			::close(fd);
+		});
+		created.wrote(size);
+	}
+	results.push_back(created.done());
+	
+	workload deleted("delete_storm");
+	for (unsigned f=0; f < small_files(); f++)
+		deleted.time([&] { check(::unlink((dir + "/" + std::to_string(f)).c_str()) == 0, "deleting"); });
+	results.push_back(deleted.done());
+	return results;
+}
+
+// stat everything under 'dir', each stat an operation
+static void walk(workload &w, const std::string &dir)
+{
+	DIR *const d = ::opendir(dir.c_str());
+	check(d != nullptr, "opening " + dir);
+	std::vector<std::string> subdirs;
+	while (const dirent *const entry = ::readdir(d))
+	{
+		if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+			continue;
+		const std::string path = dir + "/" + entry->d_name;
+		struct stat st;
+		w.time([&] { check(::lstat(path.c_str(), &st) == 0, "stat'ing " + path); });
+		if (S_ISDIR(st.st_mode))
+			subdirs.push_back(path);
+	}
+	::closedir(d);
+	for (const std::string &sub : subdirs)
+		walk(w, sub);
+}
+
+static result walk_tree(const std::string &name, const std::string &dir)
+{
+	workload w(name);
+	walk(w, dir);
+	return w.done();
+}
+
+static result read_original()
+{
+	const size_t chunk = 128*1024;
+	std::vector<char> buffer(chunk);
+	const int fd = ::open((mnt + "/.original" + sequentialFile).c_str(), O_RDONLY);
+	check(fd != -1, "opening");
+	
+	workload w("original_sequential_read");
+	for (size_t offset = 0; offset < sequential_size(); offset += chunk)
+		w.time([&] { check(::pread(fd, buffer.data(), chunk, offset) == ssize_t(chunk), "reading"); });
+	::close(fd);
+	return w.done();
+}
+
+static result truncate_files()
+{
+	workload w("truncate");
+	for (unsigned f=0; f < small_files(); f++)
+	{
+		const std::string path = mnt + "/truncate/" + std::to_string(f);
+		w.time([&] { check(::truncate(path.c_str(), 16*1024) == 0, "truncating " + path); });
+	}
+	return w.done();
+}
+
+static result rename_files()
+{
+	workload w("rename");
+	for (unsigned f=0; f < small_files(); f++)
+	{
+		const std::string from = mnt + "/rename/" + std::to_string(f);
+		const std::string to = mnt + "/rename/renamed-" + std::to_string(f);
+		w.time([&] { check(::rename(from.c_str(), to.c_str()) == 0, "renaming " + from); });
+	}
+	return w.done();
+}
+
+// the latency that 'fraction' of them are at or under
+static double percentile(std::vector<double> latencies, double fraction)
+{
+	if (latencies.empty())
+		return 0;
+	const size_t at = std::min(latencies.size()-1, size_t(fraction*latencies.size()));
+	std::nth_element(latencies.begin(), latencies.begin()+at, latencies.end());
+	return latencies[at];
+}
+
+static std::string json_string(const std::string &s)
+{
+	std::string j = "\"";
+	for (const char c : s)
+	{
+		if (c == '"' || c == '\\')
+			j += '\\';
+		j += c;
+	}
+	return j + "\"";
+}
+
+static void print(const std::string &cow_fuse, const std::vector<std::string> &options, const std::vector<result> &results)
+{
+	std::ostringstream o;
+	o.precision(6);
+	o << "{\n\t\"cow_fuse\": " << json_string(cow_fuse) << ",\n\t\"options\": [";
+	for (size_t i=0; i < options.size(); i++)
+		o << (i ? ", " : "") << json_string(options[i]);
+	o << "],\n\t\"scale\": " << scale << ",\n\t\"workloads\": [\n";
+	for (size_t i=0; i < results.size(); i++)
+	{
+		const result &r = results[i];
+		o << "\t\t{\n"
+			<< "\t\t\t\"name\": " << json_string(r.name) << ",\n"
+			<< "\t\t\t\"ops\": " << r.latencies.size() << ",\n"
+			<< "\t\t\t\"seconds\": " << r.seconds << ",\n"
+			<< "\t\t\t\"ops_per_second\": " << (r.seconds > 0 ? r.latencies.size()/r.seconds : 0) << ",\n"
+			<< "\t\t\t\"p50_us\": " << percentile(r.latencies, .5) << ",\n"
+			<< "\t\t\t\"p99_us\": " << percentile(r.latencies, .99) << ",\n"
+			<< "\t\t\t\"bytes_written\": " << r.written << ",\n"
+			<< "\t\t\t\"history_bytes\": " << r.history << ",\n"
+			<< "\t\t\t\"history_bytes_per_written_byte\": ";
+		if (r.written)
+			o << double(r.history)/r.written;
+		else
+			o << "null";
+		o << "\n\t\t}" << (i+1 < results.size() ? "," : "") << "\n";
+	}
+	o << "\t]\n}\n";
+	std::cout << o.str();
+}
+
+static bool mounted()
+{
+	// only there when it's mounted
+	struct stat st;
+	return ::stat((mnt + "/.cow/stats").c_str(), &st) == 0;
+}
+
+static bool run(const char *program, const std::vector<std::string> &args)
+{
+	const pid_t pid = ::fork();
+	if (pid == 0)
+	{
+		std::vector<char*> argv;
+		argv.push_back(const_cast<char*>(program));
+		for (const std::string &a : args)
+			argv.push_back(const_cast<char*>(a.c_str()));
+		argv.push_back(nullptr);
+		::execvp(program, argv.data());
+		::_exit(127);
+	}
+	int status;
+	return pid != -1 && ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string cow_fuse, base;
+	std::vector<std::string> options;
+	bool keep = false;
+	{
+		const char *const tmp = std::getenv("TMPDIR");
+		base = tmp && *tmp ? tmp : "/tmp";
+	}
+	for (int i=1; i < argc; i++)
+	{
+		if (!cow_fuse.empty())
+			options.push_back(argv[i]); // for cow_fuse
+		else if (std::strncmp(argv[i], "--scale=", 8) == 0)
+			scale = std::max(1ul, std::strtoul(argv[i]+8, nullptr, 10));
+		else if (std::strncmp(argv[i], "--dir=", 6) == 0)
+			base = argv[i]+6;
+		else if (std::strcmp(argv[i], "--keep") == 0)
+			keep = true;
+		else if (argv[i][0] != '-')
+			cow_fuse = argv[i];
+		else
+			break;
+	}
+	if (cow_fuse.empty())
+	{
+		std::cerr << "usage: " << argv[0]
+			<< " [--scale=<n>] [--dir=<directory>] [--keep] <cow_fuse> [cow_fuse options]" << std::endl;
+		return 1;
+	}
+	
+	std::string temp = base + "/cow_bench.XXXXXX";
+	if (!::mkdtemp(&temp[0]))
+	{
+		std::cerr << "Failed to make a directory in " << base << ": " << std::strerror(errno) << std::endl;
+		return 1;
+	}
+	src = temp + "/src";
+	mnt = temp + "/mnt";
+	
+	std::vector<result> results;
+	int rc = 0;
+	pid_t fuse = -1;
+	try
+	{
+		check(::mkdir(src.c_str(), 0755) == 0, "making " + src);
+		check(::mkdir(mnt.c_str(), 0755) == 0, "making " + mnt);
+		populate();
+		
+		fuse = ::fork();
+		if (fuse == 0)
+		{
+			std::vector<std::string> args = options;
+			args.push_back("-f");
+			args.push_back(src);
+			args.push_back(mnt);
+			std::vector<char*> argv;
+			argv.push_back(const_cast<char*>(cow_fuse.c_str()));
+			for (const std::string &a : args)
+				argv.push_back(const_cast<char*>(a.c_str()));
+			argv.push_back(nullptr);
+			::execv(cow_fuse.c_str(), argv.data());
+			::_exit(127);
+		}
+		check(fuse != -1, "starting " + cow_fuse);
+		for (unsigned tries = 0; !mounted(); tries++)
+		{
+			int status;
+			if (tries == 200 || ::waitpid(fuse, &status, WNOHANG) == fuse)
+			{
+				fuse = -1;
+				throw std::runtime_error(cow_fuse + " didn't mount " + mnt);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		
+		results.push_back(overwrite_sequential());
+		results.push_back(overwrite_random());
+		results.push_back(append());
+		for (const result &r : create_delete())
+			results.push_back(r);
+		results.push_back(walk_tree("walk_working", mnt + "/tree"));
+		results.push_back(walk_tree("walk_original", mnt + "/.original/tree"));
+		results.push_back(read_original());
+		results.push_back(truncate_files());
+		results.push_back(rename_files());
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		rc = 1;
+	}
+	
+	if (fuse != -1)
+	{
+		if (!run("fusermount", { "-u", mnt }))
+			run("umount", { mnt });
+		int status;
+		::waitpid(fuse, &status, 0);
+	}
+	if (!rc)
+		print(cow_fuse, options, results);
+	if (!keep)
+		::nftw(temp.c_str(), remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+	else
+		std::cerr << "kept " << temp << std::endl;
+	return rc;
+}
@@ -0,0 +1,524 @@
+// What's changed in a directory that cow_fuse has been used on since its
+// history started, straight from the history: what was renamed, removed
+// and created, and which byte ranges of which files were changed. Nothing
+// that wasn't changed is looked at.
+//
+//   cow_diff <dir>                lists the changes
+//   cow_diff --stream <dir>       writes them to stdout, as a stream that...
+//   cow_diff --apply <copy>       ...makes a copy of the original tree
+//                                 into a copy of the working tree
+//
+// The stream is a magic number, then records, each a byte that says what
+// it is and then its fields: integers as 8 bytes, most significant first,
+// and strings as such an integer (their length) and their bytes. It puts
+// the tree in order in the same way cow_revert does, only the other way:
+//   - from the bottom up, what was removed is removed, and whatever was
+//     renamed is moved aside, into .cow-apply;
+//   - from the top down, what was moved aside is moved to where it is
+//     now, and what's new is created;
+//   - the changed ranges of each file are written, and it's truncated.
+
+#include "tools.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+
+int origin_fd=-1;
+
+static Sql db;
+static Nodes nodes(db);
+
+static const char magic[] = "cowdiff1";
+static const char staging[] = ".cow-apply";
+
+// how much of a file goes in each write record
+static const uint64_t chunk = 1024*1024;
+
+enum record : char
+{
+	record_aside='A', // path, id
+	record_remove='R', // path
+	record_mkdir='D', // path, mode
+	record_symlink='L', // path, target
+	record_create='F', // path, mode
+	record_back='B', // id, path
+	record_write='W', // path, offset, data
+	record_truncate='T', // path, size
+	record_end='E'
+};
+
+typedef std::vector<std::pair<uint64_t,uint64_t>> ranges;
+
+struct file_change
+{
+	std::string path; // where it is now
+	ranges changed; // (offset, length), up to its size
+	uint64_t size;
+};
+
+// everything that's changed
+struct changes
+{
+	// (original path, node) of what was renamed, and where it is now
+	std::vector<std::pair<std::pair<std::string,node_id>,std::string>> renamed;
+	// original path
+	std::vector<std::string> removed;
+	// where it is now, and what it was created with
+	std::vector<std::pair<std::string,std::string>> created;
+	std::vector<file_change> files;
+};
+
+static std::map<node_id,node_id> renames;
+
+// where the original 'path' is in the working tree (see working_path in cow.cpp)
+static std::string working_path(const std::string &path)
+{
+	const std::vector<std::pair<node_id,size_t>> prefixes = nodes.prefixes(path);
+	for (auto i = prefixes.rbegin(); i != prefixes.rend(); ++i)
+	{
+		const auto to = renames.find(i->first);
+		if (to != renames.end())
+			return nodes.path(to->second) + path.substr(i->second);
+	}
+	return path;
+}
+
+// the ranges of the original that were preserved, because they changed
+// (and that it might have grown to)
+static ranges preserved(node_id node)
+{
+	ranges r;
+	Sql filedata;
+	filedata.open(".cow/filedata/" + std::to_string(node));
+	filedata
+		.statement("select offset, case when typeof(data)='integer' then abs(data) else length(data) end "
+			"from historical_filedata order by offset")
+		.exec(Args<uint64_t,uint64_t>(), [&] (const std::tuple<uint64_t,uint64_t> &extent)
+		{
+			const uint64_t offset = std::get<0>(extent);
+			// where the original ended, so whatever's after it is new
+			const uint64_t length = std::get<1>(extent)%4096 == 0 && std::get<1>(extent) != 0
+				? std::get<1>(extent) : ~uint64_t(0)-offset;
+			if (!r.empty() && r.back().first+r.back().second == offset)
+				r.back().second += length;
+			else
+				r.push_back(std::make_pair(offset, length));
+		});
+	return r;
+}
+
+static bool file_size(const std::string &path, uint64_t &size)
+{
+	struct stat st;
+	if (::fstatat(origin_fd, atdir(path.c_str()), &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+		return false;
+	size = st.st_size;
+	return true;
+}
+
+static changes collect()
+{
+	changes c;
+	
+	db.statement("select node, data from historical_files where command='rename'")
+		.exec(Args<node_id,node_id>(), [&] (const std::tuple<node_id,node_id> &row)
+		{
+			renames[std::get<0>(row)] = std::get<1>(row);
+		});
+	for (const auto &r : renames)
+		c.renamed.push_back(std::make_pair(
+			std::make_pair(nodes.path(r.first), r.first), nodes.path(r.second)));
+	
+	std::set<node_id> removed;
+	db.statement("select node from historical_files where command in ('erased', 'erased_link', 'rmdir')")
+		.exec(Args<node_id>(), [&] (const std::tuple<node_id> &row)
+		{
+			removed.insert(std::get<0>(row));
+			c.removed.push_back(nodes.path(std::get<0>(row)));
+		});
+	
+	db.statement("select node, command from new_files")
+		.exec(Args<node_id,std::string>(), [&] (const std::tuple<node_id,std::string> &row)
+		{
+			const std::string path = nodes.path(std::get<0>(row));
+			c.created.push_back(std::make_pair(path, std::get<1>(row)));
+			
+			file_change f;
+			if (std::get<1>(row) == "create" && file_size(path, f.size))
+			{
+				f.path = path;
+				if (f.size)
+					f.changed.push_back(std::make_pair(0, f.size));
+				c.files.push_back(f);
+			}
+		});
+	
+	// each file with preserved blocks, where it is now
+	const int dfd = ::openat(origin_fd, ".cow/filedata", O_DIRECTORY);
+	if (DIR *const d = dfd == -1 ? nullptr : fdopendir(dfd))
+	{
+		while (const dirent *const entry = readdir(d))
+		{
+			char *end;
+			const node_id node = std::strtoll(entry->d_name, &end, 10);
+			if (*end != '\0' || node == 0 || removed.count(node))
+				continue;
+			
+			file_change f;
+			f.path = working_path(nodes.path(node));
+			if (!file_size(f.path, f.size))
+				continue;
+			for (const auto &r : preserved(node))
+				if (r.first < f.size)
+					f.changed.push_back(std::make_pair(r.first, std::min(r.second, f.size-r.first)));
+			c.files.push_back(f);
+		}
+		closedir(d);
+	}
+	return c;
+}
+
+static void list(const changes &c)
+{
+	for (const auto &r : c.renamed)
+		std::cout << "renamed " << r.first.first << " -> " << r.second << "\n";
+	for (const std::string &path : c.removed)
+		std::cout << "removed " << path << "\n";
+	for (const auto &n : c.created)
+		std::cout << "created " << n.first << " (" << n.second << ")\n";
+	for (const file_change &f : c.files)
+	{
+		std::cout << "changed " << f.path;
+		for (const auto &r : f.changed)
+			std::cout << " " << r.first << "+" << r.second;
+		std::cout << " size " << f.size << "\n";
+	}
+}
+
+static void put(uint64_t x)
+{
+	char b[8];
+	for (int i=0; i < 8; i++)
+		b[i] = char(x >> 8*(7-i));
+	std::fwrite(b, 8, 1, stdout);
+}
+
+static void put(const char *data, size_t length)
+{
+	put(length);
+	std::fwrite(data, length, 1, stdout);
+}
+
+static void put(const std::string &s)
+{
+	put(s.data(), s.size());
+}
+
+static void put(record r)
+{
+	std::fputc(r, stdout);
+}
+
+static int stream(const changes &c)
+{
+	std::fwrite(magic, sizeof(magic)-1, 1, stdout);
+	
+	// removed and renamed, from the bottom up
+	std::vector<std::pair<std::string,node_id>> away;
+	for (const std::string &path : c.removed)
+		away.push_back(std::make_pair(path, 0));
+	for (const auto &r : c.renamed)
+		away.push_back(r.first);
+	std::stable_sort(away.begin(), away.end(),
+		[] (const std::pair<std::string,node_id> &a, const std::pair<std::string,node_id> &b)
+		{
+			return depth(a.first) > depth(b.first);
+		});
+	for (const auto &a : away)
+	{
+		put(a.second ? record_aside : record_remove);
+		put(a.first);
+		if (a.second)
+			put(a.second);
+	}
+	
+	// renamed and created, from the top down
+	std::vector<std::pair<std::string,const std::string*>> here;
+	for (const auto &r : c.renamed)
+		here.push_back(std::make_pair(r.second, nullptr));
+	for (const auto &n : c.created)
+		here.push_back(std::make_pair(n.first, &n.second));
+	std::stable_sort(here.begin(), here.end(),
+		[] (const std::pair<std::string,const std::string*> &a, const std::pair<std::string,const std::string*> &b)
+		{
+			return depth(a.first) < depth(b.first);
+		});
+	std::map<std::string,node_id> renamedTo;
+	for (const auto &r : c.renamed)
+		renamedTo[r.second] = r.first.second;
+	for (const auto &h : here)
+	{
+		const std::string &path = h.first;
+		if (!h.second)
+		{
+			put(record_back);
+			put(renamedTo[path]);
+			put(path);
+			continue;
+		}
+		
+		struct stat st;
+		if (::fstatat(origin_fd, atdir(path.c_str()), &st, AT_SYMLINK_NOFOLLOW) == -1)
+		{
+			std::cerr << "error: " << path << " is gone" << std::endl;
+			return 1;
+		}
+		if (S_ISDIR(st.st_mode))
+		{
+			put(record_mkdir);
+			put(path);
+			put(st.st_mode & 07777);
+		}
+		else if (S_ISLNK(st.st_mode))
+		{
+			std::string target(PATH_MAX, '\0');
+			const ssize_t n = ::readlinkat(origin_fd, atdir(path.c_str()), &target[0], target.size());
+			if (n == -1)
+			{
+				std::cerr << "error: failed to read the link " << path << std::endl;
+				return 1;
+			}
+			target.resize(n);
+			put(record_symlink);
+			put(path);
+			put(target);
+		}
+		else
+		{
+			put(record_create);
+			put(path);
+			put(st.st_mode & 07777);
+		}
+	}
+	
+	std::vector<char> buffer(chunk);
+	for (const file_change &f : c.files)
+	{
+		const int fd = ::openat(origin_fd, atdir(f.path.c_str()), O_RDONLY);
+		if (fd == -1)
+		{
+			std::cerr << "error: failed to open " << f.path << std::endl;
+			return 1;
+		}
+		for (const auto &r : f.changed)
+		{
+			for (uint64_t at = r.first; at < r.first+r.second; at += chunk)
+			{
+				const size_t n = std::min(chunk, r.first+r.second-at);
+				if (pread(fd, buffer.data(), n, at) != ssize_t(n))
+				{
+					std::cerr << "error: failed to read " << f.path << std::endl;
+					::close(fd);
+					return 1;
+				}
+				put(record_write);
+				put(f.path);
+				put(at);
+				put(buffer.data(), n);
+			}
+		}
+		::close(fd);
+		put(record_truncate);
+		put(f.path);
+		put(f.size);
+	}
+	
+	put(record_end);
+	return std::fflush(stdout) == 0 ? 0 : 1;
+}
+
+static bool get(uint64_t &x)
+{
+	unsigned char b[8];
+	if (std::fread(b, 8, 1, stdin) != 1)
+		return false;
+	x = 0;
+	for (int i=0; i < 8; i++)
+		x = (x << 8) | b[i];
+	return true;
+}
+
+static bool get(std::string &s)
+{
+	uint64_t length;
+	if (!get(length))
+		return false;
+	s.resize(length);
+	return length == 0 || std::fread(&s[0], length, 1, stdin) == 1;
+}
+
+static int apply(const std::string &copy)
+{
+	origin_fd = ::open(copy.c_str(), O_DIRECTORY);
+	if (origin_fd == -1)
+	{
+		std::cerr << "Failed to open " << copy << std::endl;
+		return 1;
+	}
+	
+	char m[sizeof(magic)-1];
+	if (std::fread(m, sizeof(m), 1, stdin) != 1 || std::memcmp(m, magic, sizeof(m)) != 0)
+	{
+		std::cerr << "That's not a stream from cow_diff --stream" << std::endl;
+		return 1;
+	}
+	::mkdirat(origin_fd, staging, 0700);
+	
+	// the file last written to stays open
+	std::string open_path;
+	int fd = -1;
+	const auto file = [&] (const std::string &path)
+	{
+		if (path != open_path)
+		{
+			if (fd != -1)
+				::close(fd);
+			open_path = path;
+			fd = ::openat(origin_fd, atdir(path.c_str()), O_WRONLY);
+		}
+		return fd;
+	};
+	
+	std::string path, data;
+	uint64_t a, b;
+	while (true)
+	{
+		const int r = std::fgetc(stdin);
+		bool ok;
+		int result = 0;
+		switch (r)
+		{
+		case record_aside:
+			ok = get(path) && get(a);
+			if (ok)
+				result = ::renameat(origin_fd, atdir(path.c_str()),
+					origin_fd, (std::string(staging) + "/" + std::to_string(a)).c_str());
+			break;
+		case record_remove:
+			ok = get(path);
+			if (ok && (result = ::unlinkat(origin_fd, atdir(path.c_str()), 0)) == -1 && errno == EISDIR)
+				result = ::unlinkat(origin_fd, atdir(path.c_str()), AT_REMOVEDIR);
+			break;
+		case record_mkdir:
+			ok = get(path) && get(a);
+			if (ok)
+				result = ::mkdirat(origin_fd, atdir(path.c_str()), a);
+			break;
+		case record_symlink:
+			ok = get(path) && get(data);
+			if (ok)
+				result = ::symlinkat(data.c_str(), origin_fd, atdir(path.c_str()));
+			break;
+		case record_create:
+			ok = get(path) && get(a);
+			if (ok)
+			{
+				result = ::openat(origin_fd, atdir(path.c_str()), O_WRONLY|O_CREAT|O_EXCL, a);
+				if (result != -1)
+					result = ::close(result);
+			}
+			break;
+		case record_back:
+			ok = get(a) && get(path);
+			if (ok)
+				result = ::renameat(origin_fd, (std::string(staging) + "/" + std::to_string(a)).c_str(),
+					origin_fd, atdir(path.c_str()));
+			break;
+		case record_write:
+			ok = get(path) && get(a) && get(data);
+			if (ok)
+				result = file(path) != -1 && write_all(fd, data.data(), data.size(), a) ? 0 : -1;
+			break;
+		case record_truncate:
+			ok = get(path) && get(b);
+			if (ok)
+				result = file(path) == -1 ? -1 : ::ftruncate(fd, b);
+			break;
+		case record_end:
+			if (fd != -1)
+				::close(fd);
+			::unlinkat(origin_fd, staging, AT_REMOVEDIR);
+			return 0;
+		default:
+			ok = false;
+		}
+		if (!ok)
+		{
+			std::cerr << "The stream ends before it should" << std::endl;
+			return 1;
+		}
+		if (result == -1)
+		{
+			std::cerr << "error: " << char(r) << " " << path << ": " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+	}
+}
+
+static int usage(const char *argv0)
+{
+	std::cerr << "usage: " << argv0 << " [--stream] <directory>" << std::endl
+		<< "       " << argv0 << " --apply <copy of the original> < stream" << std::endl;
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	bool streaming = false, applying = false;
+	std::string dir;
+	for (int i=1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--stream") == 0)
+			streaming = true;
+		else if (std::strcmp(argv[i], "--apply") == 0)
+			applying = true;
+		else if (argv[i][0] != '-' && dir.empty())
+			dir = argv[i];
+		else
+			return usage(argv[0]);
+	}
+	if (dir.empty() || (streaming && applying))
+		return usage(argv[0]);
+	
+	if (applying)
+		return apply(dir);
+	
+	if (!open_history(dir, db, nodes))
+		return 1;
+	try
+	{
+		const changes c = collect();
+		if (streaming)
+			return stream(c);
+		list(c);
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << "error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
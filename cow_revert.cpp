@@ -0,0 +1,398 @@
+// Puts a directory that cow_fuse has been used on back the way it was when
+// its history started, in place, from the history itself: only what was
+// changed is touched, so it takes as long as the changes are big, not the
+// tree. It mustn't be mounted while this runs, and it shouldn't be
+// interrupted; once it's done, the history is empty.
+//
+// The working tree is put back in two steps:
+//   - from the bottom up, what's in new_files is removed, and whatever was
+//     renamed is moved aside, into .cow/revert;
+//   - from the top down, what was moved aside is moved back, and what was
+//     removed is made again.
+// Then the preserved blocks of each file are written back to it, and it's
+// truncated to its original size, with a thread for each of a few files
+// at a time.
+
+#include "tools.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+int origin_fd=-1;
+
+static Sql db;
+static Nodes nodes(db);
+
+static const char staging[] = ".cow/revert";
+
+static std::mutex failures_lock;
+static unsigned failures=0;
+
+static void failed(const std::string &what, int error)
+{
+	std::lock_guard<std::mutex> lock(failures_lock);
+	std::cerr << "error: " << what << ": " << std::strerror(error) << std::endl;
+	failures++;
+}
+
+// a file whose blocks are put back
+struct restore
+{
+	node_id node;
+	std::string path;
+	// if it was erased, as it was then
+	std::vector<unsigned char> stat;
+};
+
+static bool zero(int fd, uint64_t offset, uint64_t length)
+{
+	if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		return true;
+	static const char zeroes[65536] = { };
+	while (length > 0)
+	{
+		const size_t n = std::min<uint64_t>(length, sizeof(zeroes));
+		if (!write_all(fd, zeroes, n, offset))
+			return false;
+		offset += n;
+		length -= n;
+	}
+	return true;
+}
+
+// the same range of 'from', where cloned extents are
+static bool copy(int from, int fd, uint64_t offset, uint64_t length)
+{
+	loff_t in = offset, out = offset;
+	while (length > 0)
+	{
+		const ssize_t n = ::copy_file_range(from, &in, fd, &out, length, 0);
+		if (n <= 0)
+			break;
+		length -= n;
+	}
+	std::vector<char> buffer(65536);
+	while (length > 0)
+	{
+		const ssize_t n = pread(from, buffer.data(), std::min<uint64_t>(length, buffer.size()), in);
+		if (n <= 0 || !write_all(fd, buffer.data(), n, out))
+			return false;
+		in += n;
+		out += n;
+		length -= n;
+	}
+	return true;
+}
+
+static void restore_data(const restore &r)
+{
+	const int fd = ::openat(origin_fd, atdir(r.path.c_str()), O_WRONLY);
+	if (fd == -1)
+	{
+		failed("failed to open " + r.path, errno);
+		return;
+	}
+	int clones = -1;
+	
+	try
+	{
+		// see historical_filedata in cow.cpp
+		Sql filedata;
+		filedata.open(".cow/filedata/" + std::to_string(r.node));
+		
+		uint64_t end = 0;
+		std::int64_t eof = -1;
+		typedef Args<uint64_t,std::int64_t,std::string> Extent;
+		filedata
+			.statement("select offset, case when typeof(data)='integer' then data else 0 end, "
+				"case when typeof(data)='integer' then x'' else data end from historical_filedata order by offset")
+			.exec(Extent(), [&] (const Extent::tuple &extent)
+			{
+				const uint64_t offset = std::get<0>(extent);
+				const std::int64_t run = std::get<1>(extent);
+				const std::string &data = std::get<2>(extent);
+				uint64_t length;
+				bool ok;
+				if (run > 0)
+				{
+					length = run;
+					ok = zero(fd, offset, length);
+				}
+				else if (run < 0)
+				{
+					length = -run;
+					if (clones == -1)
+						clones = ::openat(origin_fd, (".cow/clones/" + std::to_string(r.node)).c_str(), O_RDONLY);
+					ok = clones != -1 && copy(clones, fd, offset, length);
+				}
+				else
+				{
+					length = data.size();
+					ok = write_all(fd, data.data(), length, offset);
+				}
+				if (!ok)
+					throw std::runtime_error("failed to write " + r.path + ": " + std::strerror(errno));
+				
+				end = std::max(end, offset+length);
+				if (length == 0 || length%4096 != 0)
+					eof = offset+length;
+			});
+		
+		// where it ended, if that's not where it ends now
+		struct stat st;
+		if (::fstat(fd, &st) == -1)
+			throw std::runtime_error("failed to stat " + r.path + ": " + std::strerror(errno));
+		uint64_t size = std::max<uint64_t>(st.st_size, end);
+		if (!r.stat.empty())
+			size = stat_field(r.stat, stat_size);
+		else if (eof != -1)
+			size = eof;
+		if (::ftruncate(fd, size) == -1)
+			throw std::runtime_error("failed to truncate " + r.path + ": " + std::strerror(errno));
+		
+		if (!r.stat.empty())
+		{
+			const struct timespec times[2] = {
+				{ time_t(stat_field(r.stat, stat_atime)), 0 },
+				{ time_t(stat_field(r.stat, stat_mtime)), 0 }
+			};
+			::futimens(fd, times);
+		}
+	}
+	catch (std::exception &e)
+	{
+		std::lock_guard<std::mutex> lock(failures_lock);
+		std::cerr << "error: " << e.what() << std::endl;
+		failures++;
+	}
+	
+	if (clones != -1)
+		::close(clones);
+	::close(fd);
+}
+
+// remove what's in new_files, and (recursively) anything left in it
+static void remove_tree(const std::string &path)
+{
+	struct stat st;
+	if (::fstatat(origin_fd, atdir(path.c_str()), &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return;
+	if (!S_ISDIR(st.st_mode))
+	{
+		if (::unlinkat(origin_fd, atdir(path.c_str()), 0) == -1)
+			failed("failed to remove " + path, errno);
+		return;
+	}
+	
+	const int dfd = ::openat(origin_fd, atdir(path.c_str()), O_DIRECTORY);
+	if (dfd != -1)
+	{
+		std::vector<std::string> names;
+		if (DIR *const d = fdopendir(dfd))
+		{
+			while (const dirent *const entry = readdir(d))
+				if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+					names.push_back(entry->d_name);
+			closedir(d);
+		}
+		else
+			::close(dfd);
+		for (const std::string &name : names)
+			remove_tree(path + "/" + name);
+	}
+	if (::unlinkat(origin_fd, atdir(path.c_str()), AT_REMOVEDIR) == -1)
+		failed("failed to remove " + path, errno);
+}
+
+int main(int argc, char *argv[])
+{
+	std::string origin_path;
+	unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+	for (int i=1; i < argc; i++)
+	{
+		if (std::strncmp(argv[i], "--jobs=", 7) == 0)
+			jobs = std::max(1ul, std::strtoul(argv[i]+7, nullptr, 10));
+		else if (argv[i][0] != '-' && origin_path.empty())
+			origin_path = argv[i];
+		else
+		{
+			std::cerr << "usage: " << argv[0] << " [--jobs=<threads>] <directory>" << std::endl;
+			return 1;
+		}
+	}
+	if (origin_path.empty())
+	{
+		std::cerr << "Must specify a path to revert" << std::endl;
+		return 1;
+	}
+	
+	if (!open_history(origin_path, db, nodes))
+		return 1;
+	if (db.hasTable("snapshots") && db.execValue<unsigned>("select count(*) from snapshots") > 0)
+	{
+		std::cerr << "Reverting " << origin_path << " would change what its snapshots have" << std::endl;
+		return 1;
+	}
+	
+	typedef Args<node_id,std::string,std::vector<unsigned char>> History;
+	std::vector<History::tuple> history;
+	db.statement("select node, command, data from historical_files")
+		.exec(History(), [&] (const History::tuple &row) { history.push_back(row); });
+	// where they are now: what's new, and what was renamed (with the node
+	// of its original path)
+	std::vector<std::pair<std::string,node_id>> now;
+	db.statement("select node, 0 from new_files union all "
+			"select data, node from historical_files where command='rename'")
+		.exec(Args<node_id,node_id>(), [&] (const std::tuple<node_id,node_id> &row)
+		{
+			now.push_back(std::make_pair(nodes.path(std::get<0>(row)), std::get<1>(row)));
+		});
+	std::stable_sort(now.begin(), now.end(),
+		[] (const std::pair<std::string,node_id> &a, const std::pair<std::string,node_id> &b)
+		{
+			return depth(a.first) > depth(b.first);
+		});
+	
+	::mkdirat(origin_fd, staging, 0700);
+	for (const auto &n : now)
+	{
+		if (n.second == 0)
+		{
+			remove_tree(n.first);
+			continue;
+		}
+		const std::string aside = std::string(staging) + "/" + std::to_string(n.second);
+		if (::renameat(origin_fd, atdir(n.first.c_str()), origin_fd, aside.c_str()) == -1)
+			failed("failed to move " + n.first + " aside", errno);
+	}
+	
+	// put back what was moved aside or removed, from the top down
+	std::vector<std::pair<std::string,const History::tuple*>> back;
+	for (const History::tuple &row : history)
+		back.push_back(std::make_pair(nodes.path(std::get<0>(row)), &row));
+	std::stable_sort(back.begin(), back.end(),
+		[] (const std::pair<std::string,const History::tuple*> &a, const std::pair<std::string,const History::tuple*> &b)
+		{
+			return depth(a.first) < depth(b.first);
+		});
+	
+	std::vector<restore> restores;
+	std::set<node_id> erased;
+	for (const auto &b : back)
+	{
+		const std::string &path = b.first;
+		const node_id node = std::get<0>(*b.second);
+		const std::string &command = std::get<1>(*b.second);
+		const std::vector<unsigned char> &data = std::get<2>(*b.second);
+		
+		if (command == "rename")
+		{
+			const std::string aside = std::string(staging) + "/" + std::to_string(node);
+			if (::renameat(origin_fd, aside.c_str(), origin_fd, atdir(path.c_str())) == -1)
+				failed("failed to move back " + path, errno);
+		}
+		else if (command == "rmdir")
+		{
+			if (::mkdirat(origin_fd, atdir(path.c_str()), stat_field(data, stat_mode) & 07777) == -1)
+				failed("failed to make " + path, errno);
+		}
+		else if (command == "erased_link")
+		{
+			const std::string target(data.begin(), data.end());
+			if (::symlinkat(target.c_str(), origin_fd, atdir(path.c_str())) == -1)
+				failed("failed to make " + path, errno);
+		}
+		else if (command == "erased")
+		{
+			const int fd = ::openat(origin_fd, atdir(path.c_str()), O_WRONLY|O_CREAT|O_EXCL,
+				stat_field(data, stat_mode) & 07777);
+			if (fd == -1)
+			{
+				failed("failed to make " + path, errno);
+				continue;
+			}
+			::close(fd);
+			erased.insert(node);
+			restore r;
+			r.node = node;
+			r.path = path;
+			r.stat = data;
+			restores.push_back(r);
+		}
+	}
+	::unlinkat(origin_fd, staging, AT_REMOVEDIR);
+	
+	// each file with preserved blocks (the erased ones already have a restore)
+	const int dfd = ::openat(origin_fd, ".cow/filedata", O_DIRECTORY);
+	if (DIR *const d = dfd == -1 ? nullptr : fdopendir(dfd))
+	{
+		while (const dirent *const entry = readdir(d))
+		{
+			char *end;
+			const node_id node = std::strtoll(entry->d_name, &end, 10);
+			if (*end != '\0' || node == 0 || erased.count(node))
+				continue;
+			restore r;
+			r.node = node;
+			r.path = nodes.path(node);
+			restores.push_back(r);
+		}
+		closedir(d);
+	}
+	
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (unsigned i=0; i < std::min<size_t>(jobs, restores.size()); i++)
+		workers.push_back(std::thread([&] ()
+		{
+			for (size_t j; (j = next++) < restores.size(); )
+				restore_data(restores[j]);
+		}));
+	for (std::thread &t : workers)
+		t.join();
+	
+	if (failures)
+	{
+		std::cerr << failures << " things couldn't be reverted, so the history was left as it is" << std::endl;
+		return 1;
+	}
+	
+	// the history is of nothing now; the next mount writes its index again,
+	// and counts what .cow takes
+	for (const char *dir : { ".cow/filedata", ".cow/clones" })
+	{
+		const int fd = ::openat(origin_fd, dir, O_DIRECTORY);
+		if (DIR *const d = fd == -1 ? nullptr : fdopendir(fd))
+		{
+			while (const dirent *const entry = readdir(d))
+				::unlinkat(fd, entry->d_name, 0);
+			closedir(d);
+		}
+	}
+	::unlinkat(origin_fd, ".cow/history.idx", 0);
+	db.exec("begin");
+	db.exec("delete from historical_files");
+	db.exec("delete from new_files");
+	if (db.hasTable("history_index"))
+		db.exec("delete from history_index");
+	if (db.hasTable("history_usage"))
+		db.exec("delete from history_usage");
+	db.exec("commit");
+	
+	std::cout << "reverted " << now.size() + history.size() << " entries and "
+		<< restores.size() << " files" << std::endl;
+	return 0;
+}
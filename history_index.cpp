@@ -0,0 +1,265 @@
+#include "history_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the file is a header, the records sorted by node, the renames sorted by
+// where they were renamed to, and then the rows' data
+namespace
+{
+const char magic[8] = { 'c','o','w','i','d','x','1','\0' };
+
+struct Header
+{
+	char magic[8];
+	std::uint64_t stamp;
+	std::uint64_t records;
+	std::uint64_t renames;
+	std::uint64_t blobsLength;
+};
+
+enum Command : std::uint8_t { NoCommand=0, Rename, Erased, ErasedLink, Rmdir };
+const char *const commandNames[] = { "", "rename", "erased", "erased_link", "rmdir" };
+}
+
+struct HistoryIndex::Record
+{
+	std::int64_t node;
+	std::int64_t target; // if renamed
+	std::uint64_t blobOffset;
+	std::uint32_t blobLength;
+	std::uint8_t isNew;
+	std::uint8_t command;
+	std::uint16_t unused;
+};
+
+struct HistoryIndex::Reverse
+{
+	std::int64_t target;
+	std::int64_t node;
+};
+
+bool HistoryIndex::open(int dirfd, const std::string &path, std::uint64_t stamp)
+{
+	close();
+	
+	const int fd = ::openat(dirfd, path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+	
+	struct stat st;
+	if (::fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(Header))
+	{
+		::close(fd);
+		return false;
+	}
+	
+	void *const m = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (m == MAP_FAILED)
+		return false;
+	
+	const Header *const header = static_cast<const Header*>(m);
+	const size_t expected = sizeof(Header) + header->records*sizeof(Record)
+		+ header->renames*sizeof(Reverse) + header->blobsLength;
+	if (std::memcmp(header->magic, magic, sizeof(magic)) != 0
+		|| header->stamp != stamp
+		|| expected != size_t(st.st_size))
+	{
+		::munmap(m, st.st_size);
+		return false;
+	}
+	
+	map = m;
+	mapLength = st.st_size;
+	
+	const char *p = static_cast<const char*>(m) + sizeof(Header);
+	records = reinterpret_cast<const Record*>(p);
+	recordsEnd = records + header->records;
+	p += header->records*sizeof(Record);
+	renames = reinterpret_cast<const Reverse*>(p);
+	renamesEnd = renames + header->renames;
+	p += header->renames*sizeof(Reverse);
+	blobs = reinterpret_cast<const unsigned char*>(p);
+	blobsLength = header->blobsLength;
+	return true;
+}
+
+void HistoryIndex::close()
+{
+	if (map)
+		::munmap(map, mapLength);
+	map = nullptr;
+	mapLength = 0;
+	records = recordsEnd = nullptr;
+	renames = renamesEnd = nullptr;
+	blobs = nullptr;
+	blobsLength = 0;
+	changes.clear();
+}
+
+static void write_all(int fd, const void *data, size_t length)
+{
+	const char *p = static_cast<const char*>(data);
+	while (length)
+	{
+		const ssize_t w = ::write(fd, p, length);
+		if (w == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write history index: " + std::to_string(errno));
+		}
+		p += w;
+		length -= w;
+	}
+}
+
+void HistoryIndex::write(Sql &db, int dirfd, const std::string &path, std::uint64_t stamp)
+{
+	std::map<node_id, Record> records;
+	std::vector<Reverse> renames;
+	std::vector<unsigned char> blobs;
+	
+	typedef Args<std::int64_t,std::string,std::vector<unsigned char>> Row;
+	db.statement("select node, command, data from historical_files")
+		.exec(Row(), [&] (const Row::tuple &row)
+		{
+			Record &r = records[std::get<0>(row)];
+			const std::string &command = std::get<1>(row);
+			const std::vector<unsigned char> &data = std::get<2>(row);
+			
+			r.command = NoCommand;
+			for (std::uint8_t c = Rename; c <= Rmdir; c++)
+				if (command == commandNames[c])
+					r.command = c;
+			if (r.command == NoCommand)
+				throw std::runtime_error("can't index history command " + command);
+			
+			if (r.command == Rename)
+			{
+				r.target = std::stoll(std::string(data.begin(), data.end()));
+				Reverse rev;
+				rev.target = r.target;
+				rev.node = std::get<0>(row);
+				renames.push_back(rev);
+			}
+			else
+			{
+				r.blobOffset = blobs.size();
+				r.blobLength = data.size();
+				blobs.insert(blobs.end(), data.begin(), data.end());
+			}
+		});
+	
+	db.statement("select node from new_files")
+		.exec(Args<std::int64_t>(), [&] (const std::tuple<std::int64_t> &row)
+		{
+			records[std::get<0>(row)].isNew = 1;
+		});
+	
+	std::sort(renames.begin(), renames.end(),
+		[] (const Reverse &a, const Reverse &b) { return a.target < b.target; });
+	
+	Header header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.stamp = stamp;
+	header.records = records.size();
+	header.renames = renames.size();
+	header.blobsLength = blobs.size();
+	
+	const std::string temporary = path + ".new";
+	const int fd = ::openat(dirfd, temporary.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1)
+		throw std::runtime_error("failed to create " + temporary + ": " + std::to_string(errno));
+	try
+	{
+		write_all(fd, &header, sizeof(header));
+		for (auto &r : records)
+		{
+			r.second.node = r.first;
+			write_all(fd, &r.second, sizeof(Record));
+		}
+		if (!renames.empty())
+			write_all(fd, &renames.front(), renames.size()*sizeof(Reverse));
+		if (!blobs.empty())
+			write_all(fd, &blobs.front(), blobs.size());
+		if (::fsync(fd) == -1)
+			throw std::runtime_error("failed to sync " + temporary + ": " + std::to_string(errno));
+	}
+	catch (...)
+	{
+		::close(fd);
+		::unlinkat(dirfd, temporary.c_str(), 0);
+		throw;
+	}
+	::close(fd);
+	
+	if (::renameat(dirfd, temporary.c_str(), dirfd, path.c_str()) == -1)
+		throw std::runtime_error("failed to replace " + path + ": " + std::to_string(errno));
+}
+
+const HistoryIndex::Record* HistoryIndex::find(node_id node) const
+{
+	const Record *const r = std::lower_bound(records, recordsEnd, node,
+		[] (const Record &a, node_id n) { return a.node < n; });
+	if (r == recordsEnd || r->node != node)
+		return nullptr;
+	return r;
+}
+
+bool HistoryIndex::renamedTo(node_id node, node_id &to) const
+{
+	if (!map || changes.count(node))
+		return false;
+	const Record *const r = find(node);
+	to = r && r->command == Rename ? r->target : 0;
+	return true;
+}
+
+bool HistoryIndex::renamedFrom(node_id node, node_id &from) const
+{
+	if (!map || changes.count(node))
+		return false;
+	const Reverse *const r = std::lower_bound(renames, renamesEnd, node,
+		[] (const Reverse &a, node_id n) { return a.target < n; });
+	from = r != renamesEnd && r->target == node ? r->node : 0;
+	return true;
+}
+
+bool HistoryIndex::isNew(node_id node, bool &isNew) const
+{
+	if (!map || changes.count(node))
+		return false;
+	const Record *const r = find(node);
+	isNew = r && r->isNew;
+	return true;
+}
+
+bool HistoryIndex::command(node_id node, std::string &command, std::vector<unsigned char> &data) const
+{
+	if (!map || changes.count(node))
+		return false;
+	const Record *const r = find(node);
+	command.clear();
+	data.clear();
+	if (!r || r->command == NoCommand)
+		return true;
+	
+	command = commandNames[r->command];
+	if (r->command == Rename)
+	{
+		const std::string target = std::to_string(r->target);
+		data.assign(target.begin(), target.end());
+	}
+	else if (r->blobOffset + r->blobLength <= blobsLength)
+		data.assign(blobs + r->blobOffset, blobs + r->blobOffset + r->blobLength);
+	return true;
+}
@@ -0,0 +1,63 @@
+#ifndef HISTORY_INDEX_H
+#define HISTORY_INDEX_H
+
+#include "nodes.h"
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// A read-only copy of historical_files and new_files, sorted by node and
+// memory-mapped from .cow, so that looking a node up is a binary search
+// in the page cache instead of a query.
+//
+// It's written when the filesystem is unmounted and is only used if the
+// history hasn't been changed since (the database keeps a stamp that has
+// to match). Nodes that are changed while mounted are remembered, and
+// for those, the database has to be asked instead.
+class HistoryIndex
+{
+public:
+	struct Record;
+	struct Reverse;
+
+private:
+	void *map=nullptr;
+	size_t mapLength=0;
+	
+	const Record *records=nullptr, *recordsEnd=nullptr;
+	const Reverse *renames=nullptr, *renamesEnd=nullptr;
+	const unsigned char *blobs=nullptr;
+	size_t blobsLength=0;
+	
+	std::unordered_set<node_id> changes;
+	
+	const Record* find(node_id node) const;
+
+public:
+	~HistoryIndex() { close(); }
+	
+	// map the index in 'path', which must have been written with 'stamp'
+	bool open(int dirfd, const std::string &path, std::uint64_t stamp);
+	void close();
+	
+	// write the index of what's in 'db' to 'path', with 'stamp'
+	static void write(Sql &db, int dirfd, const std::string &path, std::uint64_t stamp);
+	
+	// the rows of 'node' have been (or are about to be) changed
+	void changed(node_id node) { if (map) changes.insert(node); }
+	bool anyChanges() const { return !changes.empty(); }
+	
+	// each of these is false if the index can't tell, and the database
+	// has to be asked
+	
+	// 'to' is where 'node' was renamed to, or 0
+	bool renamedTo(node_id node, node_id &to) const;
+	// 'from' is the node that was renamed to 'node', or 0
+	bool renamedFrom(node_id node, node_id &from) const;
+	bool isNew(node_id node, bool &isNew) const;
+	// 'command' is empty if there's no row for 'node' in historical_files
+	bool command(node_id node, std::string &command, std::vector<unsigned char> &data) const;
+};
+
+#endif
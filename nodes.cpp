@@ -0,0 +1,278 @@
+#include "nodes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+extern int origin_fd;
+
+// the most ids to remember before starting over
+static const size_t max_known_nodes = 100000;
+
+Nodes::Nodes(Sql &db)
+	: db(db)
+{
+}
+
+node_id Nodes::child(node_id parent, const std::string &name, bool create)
+{
+	const std::pair<node_id,std::string> key(parent, name);
+	const auto i = known.find(key);
+	if (i != known.end())
+		return i->second;
+	
+	if (!create && !existing.contains(Bloom::key(parent, name)))
+		return 0;
+	
+	node_id id;
+	try
+	{
+		id = db.statement("select id from nodes where parent=? and name=?")
+			.arg(parent)
+			.arg(name)
+			.execValue<std::uint64_t>();
+	}
+	catch (no_rows&)
+	{
+		if (!create)
+			return 0;
+		id = db.statement("insert into nodes (parent, name) values(?,?)")
+			.arg(parent)
+			.arg(name)
+			.exec();
+		if (existing.full())
+			load();
+		else
+			existing.add(Bloom::key(parent, name));
+	}
+	
+	if (known.size() >= max_known_nodes)
+		known.clear();
+	known[key] = id;
+	return id;
+}
+
+node_id Nodes::walk(const std::string &path, bool create)
+{
+	node_id id = root;
+	size_t start = 1;
+	while (start < path.size())
+	{
+		size_t slash = path.find('/', start);
+		if (slash == std::string::npos)
+			slash = path.size();
+		if (slash != start)
+		{
+			id = child(id, path.substr(start, slash-start), create);
+			if (id == 0)
+				return 0;
+		}
+		start = slash+1;
+	}
+	return id;
+}
+
+std::vector<std::pair<node_id,size_t>> Nodes::prefixes(const std::string &path)
+{
+	std::vector<std::pair<node_id,size_t>> found;
+	node_id id = root;
+	size_t start = 1;
+	while (start < path.size())
+	{
+		size_t slash = path.find('/', start);
+		if (slash == std::string::npos)
+			slash = path.size();
+		if (slash != start)
+		{
+			id = child(id, path.substr(start, slash-start), false);
+			if (id == 0)
+				break;
+			found.push_back(std::make_pair(id, slash));
+		}
+		start = slash+1;
+	}
+	return found;
+}
+
+std::string Nodes::path(node_id id)
+{
+	std::string p;
+	while (id != root)
+	{
+		const std::tuple<std::int64_t,std::string> row
+			= db.statement("select parent, name from nodes where id=?")
+				.arg(id)
+				.execTypes<std::int64_t,std::string>();
+		p = "/" + std::get<1>(row) + p;
+		id = std::get<0>(row);
+	}
+	if (p.empty())
+		p = "/";
+	return p;
+}
+
+// move the files under 'from' (named after the paths they're for) to 'to',
+// named after their node ids
+static void migrate_files(Nodes &nodes, const std::string &from, const std::string &to, const std::string &path)
+{
+	const int dfd = ::openat(origin_fd, (from + path).c_str(), O_DIRECTORY);
+	if (dfd == -1)
+		return;
+	DIR *const d = fdopendir(dfd);
+	if (!d)
+	{
+		::close(dfd);
+		return;
+	}
+	
+	std::vector<std::pair<std::string,bool>> entries;
+	while (const dirent *const entry = readdir(d))
+	{
+		if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+			continue;
+		entries.push_back(std::make_pair(entry->d_name, entry->d_type == DT_DIR));
+	}
+	closedir(d);
+	
+	for (const std::pair<std::string,bool> &e : entries)
+	{
+		const std::string sub = path + "/" + e.first;
+		if (e.second)
+		{
+			migrate_files(nodes, from, to, sub);
+			::unlinkat(origin_fd, (from + sub).c_str(), AT_REMOVEDIR);
+			continue;
+		}
+		
+		// sqlite's journals go along with their database
+		std::string base = sub, suffix;
+		for (const char *s : { "-wal", "-shm", "-journal" })
+		{
+			const size_t len = std::strlen(s);
+			if (base.size() > len && base.compare(base.size()-len, len, s) == 0)
+			{
+				suffix = s;
+				base.resize(base.size()-len);
+				break;
+			}
+		}
+		const std::string dest = to + "/" + std::to_string(nodes.intern(base)) + suffix;
+		if (::renameat(origin_fd, (from + sub).c_str(), origin_fd, dest.c_str()) == -1)
+			throw std::runtime_error("failed to move " + from + sub + " to " + dest);
+	}
+}
+
+void Nodes::load()
+{
+	existing.reset(2*db.statement("select count(*) from nodes").execValue<std::uint64_t>());
+	db.statement("select parent, name from nodes")
+		.exec(Args<std::int64_t,std::string>(), [&] (const std::tuple<std::int64_t,std::string> &row)
+		{
+			existing.add(Bloom::key(std::get<0>(row), std::get<1>(row)));
+		});
+}
+
+void Nodes::open()
+{
+	db.exec("create table if not exists nodes (id integer primary key autoincrement, parent integer, name, unique (parent, name))");
+	// made before ids were never given out again
+	if (db.statement("select sql from sqlite_master where type='table' and name='nodes'")
+		.execValue<std::string>().find("autoincrement") == std::string::npos)
+	{
+		db.exec("begin");
+		try
+		{
+			db.exec("alter table nodes rename to nodes_reused");
+			db.exec("create table nodes (id integer primary key autoincrement, parent integer, name, unique (parent, name))");
+			db.exec("insert into nodes select id, parent, name from nodes_reused");
+			db.exec("drop table nodes_reused");
+			db.exec("commit");
+		}
+		catch (...)
+		{
+			db.exec("rollback");
+			throw;
+		}
+	}
+	db.exec("insert or ignore into nodes values(1, 0, '')");
+	
+	unsigned pathColumns = 0;
+	db.statement("pragma table_info(historical_files)")
+		.exec(Args<std::int64_t,std::string>(), [&] (const std::tuple<std::int64_t,std::string> &col)
+		{
+			if (std::get<1>(col) == "path")
+				pathColumns++;
+		});
+	if (pathColumns == 0)
+	{
+		load();
+		return;
+	}
+	
+	// this history was made before paths were interned
+	db.exec("begin");
+	try
+	{
+		db.exec("alter table historical_files rename to historical_files_paths");
+		db.exec("alter table new_files rename to new_files_paths");
+		db.exec("drop index if exists historical_renames");
+		db.exec("create table historical_files (node integer primary key, command, data)");
+		db.exec("create table new_files (node integer primary key, command)");
+		
+		typedef Args<std::string,std::string,std::vector<unsigned char>> Row;
+		std::vector<Row::tuple> rows;
+		db.statement("select path, command, data from historical_files_paths")
+			.exec(Row(), [&] (const Row::tuple &row) { rows.push_back(row); });
+		for (const Row::tuple &row : rows)
+		{
+			const std::string &command = std::get<1>(row);
+			Sql::Statement insert = db.statement("insert or ignore into historical_files values(?,?,?)");
+			insert.arg(intern(std::get<0>(row))).arg(command);
+			if (command == "rename")
+			{
+				const std::vector<unsigned char> &to = std::get<2>(row);
+				insert.arg(intern(std::string(to.begin(), to.end())));
+			}
+			else
+				insert.argBlob(std::get<2>(row));
+			insert.exec();
+		}
+		
+		std::vector<std::tuple<std::string,std::string>> news;
+		db.statement("select path, command from new_files_paths")
+			.exec(Args<std::string,std::string>(), [&] (const std::tuple<std::string,std::string> &row) { news.push_back(row); });
+		for (const std::tuple<std::string,std::string> &row : news)
+		{
+			db.statement("insert or ignore into new_files values(?,?)")
+				.arg(intern(std::get<0>(row)))
+				.arg(std::get<1>(row))
+				.exec();
+		}
+		
+		db.exec("drop table historical_files_paths");
+		db.exec("drop table new_files_paths");
+		
+		for (const char *dir : { ".cow/filedata", ".cow/clones" })
+		{
+			const std::string from = std::string(dir) + "-paths";
+			if (::renameat(origin_fd, dir, origin_fd, from.c_str()) == -1)
+				continue;
+			::mkdirat(origin_fd, dir, 0777);
+			migrate_files(*this, from, dir, "");
+			::unlinkat(origin_fd, from.c_str(), AT_REMOVEDIR);
+		}
+		db.exec("commit");
+		load();
+	}
+	catch (...)
+	{
+		db.exec("rollback");
+		forget();
+		throw;
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef NODES_H
+#define NODES_H
+
+#include "sql.h"
+#include "bloom.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::int64_t node_id;
+
+// Paths in the history are interned in the "nodes" table as
+// (id, parent id, name), so that history rows and per-file data refer to
+// a small integer instead of a full path. The root is node 1.
+//
+// Lookups walk the path a component at a time, remembering what they've
+// found; a node is never removed, so a remembered id stays valid unless
+// the transaction that created it is rolled back (see forget()). Ids are
+// never given out twice, as files in .cow are named after them.
+//
+// Most paths are never interned at all, so which (parent, name) pairs
+// exist is also kept in a Bloom filter, which lets a lookup of such a path
+// give up without a query.
+class Nodes
+{
+	Sql &db;
+	std::map<std::pair<node_id,std::string>, node_id> known;
+	Bloom existing;
+	
+	node_id child(node_id parent, const std::string &name, bool create);
+	node_id walk(const std::string &path, bool create);
+	void load();
+	
+public:
+	static const node_id root = 1;
+	
+	Nodes(Sql &db);
+	
+	// create the table, and convert a history that is still keyed by paths
+	void open();
+	
+	// the node of 'path', or 0 if there's none
+	node_id find(const std::string &path) { return walk(path, false); }
+	// the node of 'path', creating it (and its parents) if need be
+	node_id intern(const std::string &path) { return walk(path, true); }
+	
+	std::string path(node_id id);
+	
+	// the nodes of those leading components of 'path' that have one, each
+	// with the length of 'path' up to the end of that component
+	std::vector<std::pair<node_id,size_t>> prefixes(const std::string &path);
+	
+	// nodes created since the last commit may have been rolled back
+	void forget() { known.clear(); }
+};
+
+#endif
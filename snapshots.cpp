@@ -0,0 +1,424 @@
+#include "snapshots.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern int origin_fd;
+
+void Snapshots::open()
+{
+	db.exec("create table if not exists snapshots (name text primary key, generation integer, seq integer)");
+	db.exec("create table if not exists snapshot_log ("
+		"seq integer primary key autoincrement, generation integer, op text, "
+		"path integer, target integer, object integer, data)");
+	db.exec("create index if not exists snapshot_log_path on snapshot_log (path, seq)");
+	db.exec("create index if not exists snapshot_log_target on snapshot_log (target, seq)");
+	db.exec("create index if not exists snapshot_log_object on snapshot_log (object, generation)");
+	db.exec("create table if not exists snapshot_stores (store integer primary key autoincrement, inode integer unique)");
+	
+	current = db.statement("select coalesce(max(generation)+1, 0) from snapshots").execValue<std::uint64_t>();
+	taken = current != 0;
+	storing = db.statement("select count(*) from snapshot_stores").execValue<unsigned>() > 0;
+}
+
+bool Snapshots::take(const std::string &name)
+{
+	if (db.statement("select count(*) from snapshots where name=?").arg(name).execValue<unsigned>() > 0)
+		return false;
+	db.statement("insert into snapshots values(?, ?, (select coalesce(max(seq),0)+1 from snapshot_log))")
+		.arg(name)
+		.arg(current)
+		.exec();
+	current++;
+	taken = true;
+	return true;
+}
+
+bool Snapshots::find(const std::string &name, Point &point)
+{
+	try
+	{
+		const std::tuple<std::int64_t,std::int64_t> row
+			= db.statement("select generation, seq from snapshots where name=?")
+				.arg(name)
+				.execTypes<std::int64_t,std::int64_t>();
+		point.generation = std::get<0>(row) + 1;
+		point.seq = std::get<1>(row);
+		return true;
+	}
+	catch (no_rows&)
+	{
+		return false;
+	}
+}
+
+std::vector<std::string> Snapshots::names()
+{
+	std::vector<std::string> n;
+	db.statement("select name from snapshots order by generation")
+		.exec(Args<std::string>(), [&] (const std::tuple<std::string> &row)
+		{
+			n.push_back(std::get<0>(row));
+		});
+	return n;
+}
+
+bool Snapshots::dropOldest(std::string &name, std::uint64_t &freed)
+{
+	freed = 0;
+	try
+	{
+		name = db.statement("select name from snapshots order by generation limit 1").execValue<std::string>();
+	}
+	catch (no_rows&)
+	{
+		return false;
+	}
+	db.statement("delete from snapshots where name=?").arg(name).exec();
+	
+	// what the oldest one left needs; if there are none left, nothing is
+	std::int64_t generation, seq;
+	try
+	{
+		const std::tuple<std::int64_t,std::int64_t> row
+			= db.statement("select generation, seq from snapshots order by generation limit 1")
+				.execTypes<std::int64_t,std::int64_t>();
+		generation = std::get<0>(row) + 1;
+		seq = std::get<1>(row);
+	}
+	catch (no_rows&)
+	{
+		taken = false;
+		generation = current + 1;
+		seq = db.statement("select coalesce(max(seq),0)+1 from snapshot_log").execValue<std::uint64_t>();
+	}
+	db.statement("delete from snapshot_log where seq<?").arg(seq).exec();
+	
+	// the stores of files that are gone, once nothing refers to them, and
+	// what the others kept before then; the files go last, so that if
+	// anything fails on the way, all that's left is what isn't needed
+	std::vector<std::int64_t> gone, stores;
+	db.statement("select store, inode is null and not exists "
+			"(select 1 from snapshot_log where op='erased' and object=store) from snapshot_stores")
+		.exec(Args<std::int64_t,int>(), [&] (const std::tuple<std::int64_t,int> &row)
+		{
+			(std::get<1>(row) ? gone : stores).push_back(std::get<0>(row));
+		});
+	for (const std::int64_t store : gone)
+		db.statement("delete from snapshot_stores where store=?").arg(store).exec();
+	storing = !stores.empty();
+	
+	const auto remove = [&] (const std::string &path)
+	{
+		struct stat st;
+		if (::fstatat(origin_fd, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0
+			&& ::unlinkat(origin_fd, path.c_str(), 0) == 0)
+			freed += std::uint64_t(st.st_blocks)*512;
+	};
+	for (const std::int64_t store : gone)
+	{
+		for (const char *suffix : { "", "-wal", "-shm" })
+			remove(storePath(store) + suffix);
+		remove(storeFile(store));
+	}
+	for (const std::int64_t store : stores)
+	{
+		SnapshotStore kept;
+		if (kept.open(store, false))
+			kept.forget(generation);
+	}
+	return true;
+}
+
+void Snapshots::log(const char *op, node_id path, node_id target, std::int64_t object, const std::vector<unsigned char> &data)
+{
+	Sql::Statement s = db.statement("insert into snapshot_log (generation, op, path, target, object, data) "
+		"values(?, ?, ?, ?, ?, ?)");
+	s.arg(current).arg(std::string(op)).arg(path).arg(target).arg(object);
+	if (data.empty())
+		s.argNull();
+	else
+		s.argBlob(data);
+	s.exec();
+}
+
+void Snapshots::created(const std::string &path, ino_t inode)
+{
+	if (inode && storing)
+		db.statement("update snapshot_stores set inode=null where inode=?").arg(std::int64_t(inode)).exec();
+	if (!any())
+		return;
+	log("create", nodes.intern(path), 0, inode, std::vector<unsigned char>());
+}
+
+void Snapshots::renamed(const std::string &from, const std::string &to)
+{
+	if (!any())
+		return;
+	log("rename", nodes.intern(from), nodes.intern(to), 0, std::vector<unsigned char>());
+}
+
+void Snapshots::erased(const std::string &path, std::int64_t store, const std::vector<unsigned char> &stat)
+{
+	if (!any())
+		return;
+	log("erased", nodes.intern(path), 0, store, stat);
+}
+
+void Snapshots::removedDir(const std::string &path, const std::vector<unsigned char> &stat)
+{
+	if (!any())
+		return;
+	log("rmdir", nodes.intern(path), 0, 0, stat);
+}
+
+bool Snapshots::createdNow(ino_t inode)
+{
+	return db.statement("select count(*) from snapshot_log where object=? and generation=? and op='create'")
+		.arg(std::int64_t(inode))
+		.arg(current)
+		.execValue<unsigned>() > 0;
+}
+
+std::int64_t Snapshots::storeOf(ino_t inode, bool create)
+{
+	try
+	{
+		return db.statement("select store from snapshot_stores where inode=?")
+			.arg(std::int64_t(inode))
+			.execValue<std::uint64_t>();
+	}
+	catch (no_rows&)
+	{
+	}
+	if (!create)
+		return 0;
+	storing = true;
+	return db.statement("insert into snapshot_stores (inode) values(?)").arg(std::int64_t(inode)).exec();
+}
+
+std::int64_t Snapshots::detach(ino_t inode)
+{
+	const std::int64_t store = storeOf(inode, true);
+	db.statement("update snapshot_stores set inode=null where store=?").arg(store).exec();
+	return store;
+}
+
+Snapshots::Entry Snapshots::resolve(const Point &point, const std::string &path, std::vector<std::string> *trail)
+{
+	Entry entry;
+	std::string at = path;
+	std::int64_t seq = point.seq;
+	
+	while (true)
+	{
+		if (trail)
+			trail->push_back(at);
+		
+		// the next thing done to 'at' or to a directory it's in
+		const std::vector<std::pair<node_id,size_t>> prefixes = nodes.prefixes(at);
+		if (prefixes.empty())
+			break;
+		std::string in = "(";
+		for (size_t i=0; i < prefixes.size(); i++)
+			in += i ? ",?" : "?";
+		in += ")";
+		
+		Sql::Statement s = db.statement("select seq, op, path, target, object, data from snapshot_log "
+			"where seq>=? and (path in " + in + " or target in " + in + ") order by seq limit 1");
+		s.arg(seq);
+		for (int twice=0; twice < 2; twice++)
+			for (const auto &p : prefixes)
+				s.arg(p.first);
+		
+		typedef Args<std::int64_t,std::string,std::int64_t,std::int64_t,std::int64_t,std::vector<unsigned char>> Row;
+		bool found = false;
+		Row::tuple row;
+		s.exec(Row(), [&] (const Row::tuple &r)
+		{
+			row = r;
+			found = true;
+		});
+		if (!found)
+			break;
+		
+		seq = std::get<0>(row) + 1;
+		const std::string &op = std::get<1>(row);
+		size_t pathLength = 0;
+		bool targeted = false;
+		for (const auto &p : prefixes)
+		{
+			if (p.first == std::get<2>(row))
+				pathLength = p.second;
+			if (p.first == std::get<3>(row))
+				targeted = true;
+		}
+		
+		if (op == "rename" && pathLength)
+		{
+			// it (or a directory it's in) was moved
+			const std::string to = nodes.path(std::get<3>(row));
+			at = (to == "/" ? "" : to) + at.substr(pathLength);
+			continue;
+		}
+		// something was created or moved where it would be, so it wasn't there
+		if (op == "create" || targeted)
+			return entry;
+		
+		// it was removed; whatever was in a directory was removed first
+		if (pathLength != at.size())
+			return entry;
+		if (op == "erased" && std::get<4>(row))
+		{
+			entry.kind = Entry::Erased;
+			entry.store = std::get<4>(row);
+			entry.stat = std::get<5>(row);
+		}
+		else if (op == "rmdir")
+		{
+			entry.kind = Entry::RemovedDir;
+			entry.stat = std::get<5>(row);
+		}
+		return entry;
+	}
+	
+	entry.kind = Entry::Live;
+	entry.path = at;
+	return entry;
+}
+
+std::set<std::string> Snapshots::logged(const Point &point, const std::vector<std::string> &trail)
+{
+	std::set<std::string> names;
+	for (const std::string &dir : trail)
+	{
+		const node_id node = nodes.find(dir);
+		if (!node)
+			continue;
+		db
+			.statement("select name from snapshot_log join nodes on id=path where seq>=? and parent=? "
+				"union select name from snapshot_log join nodes on id=target where seq>=? and parent=?")
+			.arg(point.seq).arg(node)
+			.arg(point.seq).arg(node)
+			.exec(Args<std::string>(), [&] (const std::tuple<std::string> &name)
+			{
+				names.insert(std::get<0>(name));
+			});
+	}
+	return names;
+}
+
+std::string Snapshots::storePath(std::int64_t store)
+{
+	return ".cow/snapshots/" + std::to_string(store);
+}
+
+std::string Snapshots::storeFile(std::int64_t store)
+{
+	return storePath(store) + ".file";
+}
+
+bool SnapshotStore::open(std::int64_t store, bool create)
+{
+	if (db.isOpen())
+		return true;
+	
+	const std::string path = Snapshots::storePath(store);
+	if (!create && ::faccessat(origin_fd, path.c_str(), F_OK, 0) == -1)
+		return false;
+	
+	db.open(path);
+	// a commit here is what lets the working file be changed
+	db.exec("pragma synchronous = FULL");
+	db.exec("create table if not exists snapshot_filedata (offset integer, generation integer, data, "
+		"primary key (offset, generation))");
+	db.exec("create table if not exists snapshot_sizes (generation integer primary key, size integer)");
+	return true;
+}
+
+bool SnapshotStore::size(std::int64_t generation, std::uint64_t &size)
+{
+	try
+	{
+		size = db.statement("select size from snapshot_sizes where generation>=? order by generation limit 1")
+			.arg(generation)
+			.execValue<std::uint64_t>();
+		return true;
+	}
+	catch (no_rows&)
+	{
+		return false;
+	}
+}
+
+bool SnapshotStore::block(std::int64_t generation, std::uint64_t offset, std::string &data)
+{
+	try
+	{
+		const std::tuple<std::int64_t,std::string> row
+			= db.statement("select case when typeof(data)='integer' then data else 0 end, data "
+				"from snapshot_filedata where offset=? and generation>=? order by generation limit 1")
+				.arg(offset)
+				.arg(generation)
+				.execTypes<std::int64_t,std::string>();
+		if (std::get<0>(row) > 0)
+			data.assign(std::get<0>(row), '\0');
+		else
+			data = std::move(std::get<1>(row));
+		return true;
+	}
+	catch (no_rows&)
+	{
+		return false;
+	}
+}
+
+std::vector<std::uint64_t> SnapshotStore::kept(std::int64_t generation, bool &hasSize)
+{
+	std::vector<std::uint64_t> offsets;
+	db.statement("select offset from snapshot_filedata where generation=?")
+		.arg(generation)
+		.exec(Args<std::uint64_t>(), [&] (const std::tuple<std::uint64_t> &row)
+		{
+			offsets.push_back(std::get<0>(row));
+		});
+	hasSize = db.statement("select count(*) from snapshot_sizes where generation=?")
+		.arg(generation)
+		.execValue<unsigned>() > 0;
+	return offsets;
+}
+
+void SnapshotStore::keepSize(std::int64_t generation, std::uint64_t size)
+{
+	db.statement("insert or ignore into snapshot_sizes values(?, ?)")
+		.arg(generation)
+		.arg(size)
+		.exec();
+}
+
+void SnapshotStore::forget(std::int64_t generation)
+{
+	db.statement("delete from snapshot_filedata where generation<?").arg(generation).exec();
+	db.statement("delete from snapshot_sizes where generation<?").arg(generation).exec();
+	const std::uint64_t freePages = db.statement("pragma freelist_count").execValue<std::uint64_t>();
+	const std::uint64_t pages = db.statement("pragma page_count").execValue<std::uint64_t>();
+	if (freePages*4 >= pages)
+		db.exec("vacuum");
+	db.exec("pragma wal_checkpoint(TRUNCATE)");
+}
+
+void SnapshotStore::keep(std::int64_t generation, std::uint64_t offset, const char *data, size_t length)
+{
+	Sql::Statement s = db.statement("insert or ignore into snapshot_filedata values(?, ?, ?)");
+	s.arg(offset).arg(generation);
+	if (length && data[0] == 0 && std::memcmp(data, data+1, length-1) == 0)
+		s.arg(std::int64_t(length));
+	else if (length == 0)
+		s.argBlob("");
+	else
+		s.argBlob(reinterpret_cast<const std::uint8_t*>(data), length);
+	s.exec();
+}
@@ -0,0 +1,136 @@
+#ifndef SNAPSHOTS_H
+#define SNAPSHOTS_H
+
+#include "nodes.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// Named snapshots of the working tree, as /.snapshots/<name>.
+//
+// Time is divided into generations; taking a snapshot seals the current
+// one and starts the next, which is all it costs. Whatever is changed
+// after that keeps what it was, in the generation it was changed in:
+//
+// - each file's blocks (and size), the first time they're changed in a
+//   generation, go into that file's store (see SnapshotStore), and as a
+//   snapshot sees a block as it was when the next generation after it
+//   started changing it, it takes the first one kept since it was taken;
+// - creating, renaming and removing anything is written to snapshot_log,
+//   and what a path in a snapshot is now is found by following it through
+//   what's been logged since the snapshot was taken. A file that's removed
+//   is moved into .cow/snapshots (see storeFile()) rather than deleted.
+//
+// Until the first snapshot is taken, none of this costs anything.
+class Snapshots
+{
+public:
+	// where a snapshot starts
+	struct Point
+	{
+		std::int64_t generation=0; // the first one after it was taken
+		std::int64_t seq=0; // the first row of snapshot_log after it was taken
+	};
+	
+	// what a path in a snapshot is now
+	struct Entry
+	{
+		enum Kind { Missing, Live, Erased, RemovedDir };
+		Kind kind=Missing;
+		std::string path; // if Live, where it is in the working tree
+		std::int64_t store=0; // if Erased, whose file it's in now
+		std::vector<unsigned char> stat; // if Erased or RemovedDir, as it was then
+	};
+
+private:
+	Sql &db;
+	Nodes &nodes;
+	std::int64_t current=0;
+	bool taken=false;
+	bool storing=false; // whether there are any stores
+	
+	void log(const char *op, node_id path, node_id target, std::int64_t object, const std::vector<unsigned char> &data);
+
+public:
+	Snapshots(Sql &db, Nodes &nodes) : db(db), nodes(nodes) { }
+	
+	// create the tables
+	void open();
+	
+	std::int64_t generation() const { return current; }
+	bool any() const { return taken; }
+	bool anyStores() const { return storing; }
+	
+	// false if there's already one called 'name'
+	bool take(const std::string &name);
+	bool find(const std::string &name, Point &point);
+	std::vector<std::string> names();
+	// drop the oldest, and what only it needed, which frees 'freed' bytes
+	// of .cow/snapshots; false if there are none
+	bool dropOldest(std::string &name, std::uint64_t &freed);
+	
+	// what's been done to the working tree, which is only logged once
+	// there's a snapshot. A file that's created (with 'inode') has no store
+	// yet, even if what had its inode before still has one
+	void created(const std::string &path, ino_t inode);
+	void renamed(const std::string &from, const std::string &to);
+	// 'store' (if not 0) has what 'path' was, its file and kept blocks
+	void erased(const std::string &path, std::int64_t store, const std::vector<unsigned char> &stat);
+	void removedDir(const std::string &path, const std::vector<unsigned char> &stat);
+	
+	// whether the file with 'inode' was created in the current generation,
+	// so that no snapshot has it
+	bool createdNow(ino_t inode);
+	
+	// the store of the file with 'inode', 0 if it has none yet
+	std::int64_t storeOf(ino_t inode, bool create);
+	// the file with 'inode' is no more, so its store is now only its
+	// store's; returns its store, with one made for it if need be
+	std::int64_t detach(ino_t inode);
+	
+	// what 'path' of the snapshot at 'point' is now; 'trail' gets each
+	// path it was at, if given
+	Entry resolve(const Point &point, const std::string &path, std::vector<std::string> *trail=nullptr);
+	
+	// the names of what may have been in 'dir' of the snapshot at 'point'
+	// besides what's in it now ('trail' as given by resolve())
+	std::set<std::string> logged(const Point &point, const std::vector<std::string> &trail);
+	
+	static std::string storePath(std::int64_t store);
+	static std::string storeFile(std::int64_t store);
+};
+
+// What's been kept of a file's blocks and size for snapshots: a block as
+// it was when it was first changed in a generation is kept under that
+// generation (with the same encoding as historical_filedata, except that
+// a run is never more than a block), as is the size it had then.
+class SnapshotStore
+{
+	Sql db;
+
+public:
+	// false if it doesn't exist and 'create' is false
+	bool open(std::int64_t store, bool create);
+	bool isOpen() const { return db.isOpen(); }
+	
+	// as of the snapshot whose first generation after is 'generation';
+	// false if nothing's been kept since, and it's what the file has now
+	bool size(std::int64_t generation, std::uint64_t &size);
+	bool block(std::int64_t generation, std::uint64_t offset, std::string &data);
+	
+	// the blocks kept for 'generation', and whether its size was
+	std::vector<std::uint64_t> kept(std::int64_t generation, bool &hasSize);
+	
+	void begin() { db.exec("begin"); }
+	void commit() { db.exec("commit"); }
+	void rollback() { db.exec("rollback"); }
+	void keepSize(std::int64_t generation, std::uint64_t size);
+	void keep(std::int64_t generation, std::uint64_t offset, const char *data, size_t length);
+	// no snapshot needs what was kept before 'generation'
+	void forget(std::int64_t generation);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "sql.h"
 
 #include <sstream>
+#include <unordered_map>
 
 Sql::Sql()
 {
@@ -8,11 +9,17 @@ Sql::Sql()
 }
 
 Sql::~Sql()
+{
+	close();
+}
+
+void Sql::close()
 {
 	if (db && SQLITE_BUSY==sqlite3_close(db))
 	{
 		std::cerr << "Warning: sqlite db not closed, statements not finalized" << std::endl;
 	}
+	db = nullptr;
 }
 
 void Sql::open(const std::string &database, int opt)
@@ -322,6 +329,20 @@ std::string Sql::Statement::boundValues()
 }
 
 
+// what each statement's timed as, so that preparing one again doesn't
+// have to ask Stats (and take its lock); a thread's own, so that this
+// doesn't either
+static unsigned metric_of(const std::string &sql)
+{
+	static thread_local std::unordered_map<std::string, unsigned> metrics;
+	const auto found = metrics.find(sql);
+	if (found != metrics.end())
+		return found->second;
+	const unsigned metric = Stats::metric("sql " + sql);
+	metrics[sql] = metric;
+	return metric;
+}
+
 Sql::Statement Sql::statement(const std::string &sql)
 {
 	Sql::Statement s;
@@ -335,6 +356,7 @@ Sql::Statement Sql::statement(const std::string &sql)
 	s.shared->stmt = stmt;
 	s.shared->db = this;
 	s.shared->statement = sql;
+	s.shared->metric = Stats::enabled() ? metric_of(sql) : 0;
 	return s;
 }
 
@@ -12,6 +12,8 @@
 
 #include <sqlite3.h>
 
+#include "stats.h"
+
 //#define SQL_TRACE
 
 template<class T>
@@ -160,6 +162,7 @@ public:
 
 			std::string statement;
 			Sql *db;
+			unsigned metric; // what it's timed as (see Stats)
 
 		} *shared;
 
@@ -215,6 +218,7 @@ public:
 	void open(const std::string &database, int opt=Sql_WAL);
 	
 	bool isOpen() const { return !!db; }
+	void close();
 
 	Statement statement(const std::string &sql);
 
@@ -305,9 +309,20 @@ inline std::int64_t Sql::Statement::exec(const Params &, const Function &functio
 	
 	typename Params::tuple row;
 	
+	// only the time spent in sqlite counts, not what's done with each row
+	const bool timing = Stats::enabled();
+	std::chrono::steady_clock::duration stepping(0);
+	
 	while (1)
 	{
-		x = sqlite3_step(stmt);
+		if (timing)
+		{
+			const std::chrono::steady_clock::time_point before = std::chrono::steady_clock::now();
+			x = sqlite3_step(stmt);
+			stepping += std::chrono::steady_clock::now() - before;
+		}
+		else
+			x = sqlite3_step(stmt);
 		if (x == SQLITE_ROW)
 		{
 			Params::col(row, stmt);
@@ -345,6 +360,8 @@ inline std::int64_t Sql::Statement::exec(const Params &, const Function &functio
 	}
 
 	clearParameters();
+	if (timing)
+		Stats::record(shared->metric, std::chrono::duration_cast<std::chrono::nanoseconds>(stepping).count());
 
 #ifdef SQL_TRACE
 	std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
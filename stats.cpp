@@ -0,0 +1,191 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+std::atomic<bool> Stats::on{false};
+
+namespace
+{
+// one thread's; only it writes to them, so they're only atomic so that
+// they can be read while it does
+struct counters
+{
+	std::atomic<std::uint64_t> calls[Stats::capacity];
+	std::atomic<std::uint64_t> nanoseconds[Stats::capacity];
+	std::atomic<std::uint64_t> histogram[Stats::capacity][Stats::buckets];
+};
+
+// what's shared, made when it's first used, as metrics are made by other
+// files' statics
+struct registry
+{
+	std::mutex lock;
+	std::map<std::string, unsigned> indexes;
+	std::vector<std::string> names;
+	// every thread's that's recorded anything, which are kept when it's gone
+	std::vector<counters*> threads;
+};
+
+registry &shared()
+{
+	static registry r;
+	return r;
+}
+
+thread_local counters *mine = nullptr;
+
+void add(std::atomic<std::uint64_t> &counter, std::uint64_t by)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+// the histogram bucket of a duration
+unsigned bucket(std::uint64_t nanoseconds)
+{
+	unsigned b = 0;
+	while (nanoseconds > 1 && b < Stats::buckets-1)
+	{
+		nanoseconds >>= 1;
+		b++;
+	}
+	return b;
+}
+
+std::string duration(std::uint64_t nanoseconds)
+{
+	std::ostringstream s;
+	if (nanoseconds < 10000)
+		s << nanoseconds << "ns";
+	else if (nanoseconds < 10000000)
+		s << nanoseconds/1000 << "us";
+	else if (nanoseconds < 10000000000ull)
+		s << nanoseconds/1000000 << "ms";
+	else
+		s << nanoseconds/1000000000 << "s";
+	return s.str();
+}
+
+struct totals
+{
+	std::string name;
+	std::uint64_t calls=0, nanoseconds=0;
+	std::uint64_t histogram[Stats::buckets] = {};
+	
+	// the bucket that the call at 'fraction' of them falls in, as the
+	// duration that it's under
+	std::uint64_t percentile(double fraction) const
+	{
+		const std::uint64_t wanted = std::max<std::uint64_t>(1, fraction*calls + 0.5);
+		std::uint64_t seen = 0;
+		for (unsigned b = 0; b < Stats::buckets; b++)
+		{
+			seen += histogram[b];
+			if (seen >= wanted)
+				return std::uint64_t(2) << b;
+		}
+		return std::uint64_t(2) << (Stats::buckets-1);
+	}
+};
+
+}
+
+void Stats::enable()
+{
+	on = true;
+}
+
+unsigned Stats::metric(const std::string &name)
+{
+	registry &r = shared();
+	std::lock_guard<std::mutex> l(r.lock);
+	const auto found = r.indexes.find(name);
+	if (found != r.indexes.end())
+		return found->second;
+	if (r.names.size() == capacity-1)
+		return capacity-1;
+	r.names.push_back(name);
+	r.indexes[name] = r.names.size()-1;
+	return r.names.size()-1;
+}
+
+void Stats::record(unsigned metric, std::uint64_t nanoseconds)
+{
+	if (!enabled())
+		return;
+	if (!mine)
+	{
+		counters *const c = new counters();
+		registry &r = shared();
+		std::lock_guard<std::mutex> l(r.lock);
+		r.threads.push_back(c);
+		mine = c;
+	}
+	add(mine->calls[metric], 1);
+	add(mine->nanoseconds[metric], nanoseconds);
+	add(mine->histogram[metric][bucket(nanoseconds)], 1);
+}
+
+std::string Stats::report()
+{
+	std::vector<totals> all;
+	std::map<std::string, totals> byKind;
+	{
+		registry &r = shared();
+		std::lock_guard<std::mutex> l(r.lock);
+		const std::vector<std::string> &names = r.names;
+		all.resize(names.size()+1);
+		for (size_t m = 0; m < all.size(); m++)
+		{
+			totals &t = all[m];
+			t.name = m < names.size() ? names[m] : "other (too many to tell apart)";
+			for (const counters *const c : r.threads)
+			{
+				const unsigned i = m < names.size() ? m : capacity-1;
+				t.calls += c->calls[i].load(std::memory_order_relaxed);
+				t.nanoseconds += c->nanoseconds[i].load(std::memory_order_relaxed);
+				for (unsigned b = 0; b < buckets; b++)
+					t.histogram[b] += c->histogram[i][b].load(std::memory_order_relaxed);
+			}
+			
+			totals &kind = byKind[t.name.substr(0, t.name.find(' '))];
+			kind.calls += t.calls;
+			kind.nanoseconds += t.nanoseconds;
+		}
+	}
+	all.erase(
+		std::remove_if(all.begin(), all.end(), [] (const totals &t) { return t.calls == 0; }),
+		all.end()
+	);
+	std::sort(
+		all.begin(), all.end(),
+		[] (const totals &a, const totals &b) { return a.nanoseconds > b.nanoseconds; }
+	);
+	
+	std::ostringstream s;
+	if (!enabled())
+		s << "(not enabled)\n";
+	// an operation's time includes that of the statements and I/O it does
+	for (const auto &kind : byKind)
+	{
+		if (kind.second.calls)
+			s << kind.first << ": " << kind.second.calls << " calls, "
+				<< duration(kind.second.nanoseconds) << "\n";
+	}
+	for (const totals &t : all)
+	{
+		s << "\n" << t.name << "\n\t" << t.calls << " calls, " << duration(t.nanoseconds)
+			<< ", p50 <" << duration(t.percentile(.5))
+			<< ", p99 <" << duration(t.percentile(.99)) << "\n\t";
+		for (unsigned b = 0; b < buckets; b++)
+		{
+			if (t.histogram[b])
+				s << " <" << duration(std::uint64_t(2) << b) << ":" << t.histogram[b];
+		}
+		s << "\n";
+	}
+	return s.str();
+}
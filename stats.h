@@ -0,0 +1,61 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// How many times each thing that's timed (each FUSE operation, SQL
+// statement, and batch of backing I/O) has been done, and how long it took,
+// as a histogram of powers of two of nanoseconds.
+//
+// Each thread counts into its own counters, so recording takes no lock
+// and nothing is shared between threads; they're only added up when
+// they're read. Nothing is counted until it's enabled.
+class Stats
+{
+public:
+	// things that can be timed; past that, they're all counted as one
+	static const unsigned capacity = 256;
+	// the last one is for everything of 2^(buckets-1) ns or more
+	static const unsigned buckets = 32;
+	
+	static void enable();
+	static bool enabled() { return on.load(std::memory_order_relaxed); }
+	
+	// what's timed as 'name', such as "sql select ..."; what comes before
+	// the first space is what it's totalled as
+	static unsigned metric(const std::string &name);
+	static void record(unsigned metric, std::uint64_t nanoseconds);
+	
+	// all of it, as text
+	static std::string report();
+	
+	// times what it's in scope for
+	class Timer
+	{
+		unsigned metric;
+		std::chrono::steady_clock::time_point start;
+		bool timing;
+	
+	public:
+		explicit Timer(unsigned metric)
+			: metric(metric), timing(Stats::enabled())
+		{
+			if (timing)
+				start = std::chrono::steady_clock::now();
+		}
+		~Timer()
+		{
+			if (timing)
+				record(metric, std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count());
+		}
+	};
+
+private:
+	static std::atomic<bool> on;
+};
+
+#endif
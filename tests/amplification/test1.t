@@ -0,0 +1,16 @@
+function pre()
+{
+	seq 1 100000 > src/nums
+}
+
+function post()
+{
+	dd if=/dev/urandom of=mnt/nums bs=4096 count=2 conv=notrunc 2> /dev/null
+	mv mnt/nums mnt/moved
+	dd if=/dev/urandom of=mnt/moved bs=4096 seek=20 count=2 conv=notrunc 2> /dev/null
+	# the file's one entry, under where it is now
+	grep -c "^/" mnt/.cow/amplification > entries
+	contains entries 1
+	grep -c "^/moved$" mnt/.cow/amplification > moved
+	contains moved 1
+}
@@ -0,0 +1,18 @@
+function pre()
+{
+	cp `which bash` src/bash
+}
+
+function post()
+{
+	# a write that keeps the file open while the original is read
+	exec 3<> mnt/bash
+	dd if=/dev/urandom bs=4096 count=100 seek=10 conv=notrunc,fsync >&3 2> /dev/null
+	matches mnt/.original/bash `which bash`
+	dd if=/dev/urandom bs=4096 count=200 seek=50 conv=notrunc >&3 2> /dev/null
+	matches mnt/.original/bash `which bash`
+	exec 3>&-
+	matches mnt/.original/bash `which bash`
+	dd if=/dev/zero of=mnt/bash bs=65536 count=4 seek=2 conv=notrunc 2> /dev/null
+	matches mnt/.original/bash `which bash`
+}
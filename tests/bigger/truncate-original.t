@@ -0,0 +1,11 @@
+function pre()
+{
+	cp `which bash` src/bash
+}
+
+function post()
+{
+	truncate -s 3K mnt/.original/bash 2> /dev/null
+	matches mnt/bash `which bash`
+	matches mnt/.original/bash `which bash`
+}
@@ -0,0 +1,18 @@
+COW_OPTIONS="--history-budget=1 --over-budget=enospc"
+
+function pre()
+{
+	head -c 4M /dev/urandom > src/file
+	cp src/file file.orig
+	head -c 4M /dev/urandom > new
+}
+
+function post()
+{
+	# what would take the history past 1MB is refused, and what's
+	# captured of the writes before that is all there
+	dd if=new of=mnt/file bs=64K conv=notrunc 2> dd.err
+	grep -c "No space left on device" dd.err > nospace
+	contains nospace 1
+	matches mnt/.original/file file.orig
+}
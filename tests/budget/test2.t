@@ -0,0 +1,21 @@
+COW_OPTIONS="--history-budget=1 --over-budget=stop-capturing"
+
+function pre()
+{
+	head -c 4M /dev/urandom > src/file
+	cp src/file file.orig
+	head -c 4M /dev/urandom > new
+}
+
+function post()
+{
+	# the writes all go ahead, and only what fits in 1MB is captured
+	dd if=new of=mnt/file bs=64K conv=notrunc 2> /dev/null
+	matches mnt/file new
+	head -c 256K file.orig > start.orig
+	head -c 256K mnt/.original/file > start
+	matches start start.orig
+	head -c 4M mnt/.original/file | tail -c 256K > end
+	tail -c 256K new > end.new
+	matches end end.new
+}
@@ -0,0 +1,25 @@
+function pre()
+{
+	seq 1 100000 > src/numbers
+	seq 1 100000 > numbers
+}
+
+function post()
+{
+	# change a block, and then put it back
+	dd if=/dev/zero of=mnt/numbers bs=4096 seek=2 count=1 conv=notrunc 2> /dev/null
+	dd if=numbers of=mnt/numbers bs=4096 skip=2 seek=2 count=1 conv=notrunc 2> /dev/null
+	sleep 1
+	matches mnt/.original/numbers numbers
+	matches mnt/numbers numbers
+	
+	# and change it again, once it's been compacted
+	dd if=/dev/zero of=mnt/numbers bs=4096 seek=2 count=1 conv=notrunc 2> /dev/null
+	matches mnt/.original/numbers numbers
+	
+	touch src/.cow/compact.pause
+	dd if=numbers of=mnt/numbers bs=4096 skip=2 seek=2 count=1 conv=notrunc 2> /dev/null
+	sleep 1
+	matches mnt/.original/numbers numbers
+	rm src/.cow/compact.pause
+}
@@ -0,0 +1,29 @@
+function pre()
+{
+	mkdir -p src/dir/sub
+	echo "hello" > src/dir/sub/testfile
+	echo "other" > src/dir/otherfile
+	seq 1 10000 > src/numbers
+	cp -r src copy
+}
+
+function post()
+{
+	echo "goodbye" > mnt/dir/sub/testfile
+	mv mnt/dir mnt/dir2
+	rm mnt/dir2/otherfile
+	echo "new" > mnt/dir2/newfile
+	truncate -s 10 mnt/numbers
+	ln -s numbers mnt/link
+}
+
+function after()
+{
+	../../cow_diff --stream src > stream
+	../../cow_diff --apply copy < stream
+	contains copy/dir2/sub/testfile "goodbye"
+	contains copy/dir2/newfile "new"
+	nofile copy/dir copy/dir2/otherfile
+	matches copy/numbers src/numbers
+	contains copy/link "$(head -c 10 src/numbers)"
+}
@@ -0,0 +1,39 @@
+function pre()
+{
+	mkdir -p src/dir/sub src/gone
+	cp `which bash` src/dir/bash
+	seq 1 100000 > src/numbers
+	echo "hello" > src/dir/sub/testfile
+	echo "other" > src/gone/otherfile
+	truncate -s 1M src/sparse
+	cp -r src copy
+}
+
+function post()
+{
+	# in place, in the middle of a block and across blocks
+	printf 'changed' | dd of=mnt/dir/bash bs=1 seek=5000 conv=notrunc 2> /dev/null
+	dd if=/dev/urandom of=mnt/dir/bash bs=4096 seek=10 count=3 conv=notrunc 2> /dev/null
+	# longer, and shorter
+	seq 1 1000 >> mnt/numbers
+	truncate -s 3000 mnt/dir/sub/testfile
+	printf 'x' | dd of=mnt/sparse bs=1 seek=600000 conv=notrunc 2> /dev/null
+	mv mnt/dir mnt/moved
+	rm -r mnt/gone
+	echo "new" > mnt/moved/newfile
+	mkdir mnt/newdir
+	cp mnt/numbers mnt/newdir/numbers
+}
+
+function after()
+{
+	../../cow_diff --stream src > stream
+	../../cow_diff --apply copy < stream
+	if diff -r -x .cow copy src > /dev/null
+	then
+		echo yes > same
+	else
+		echo no > same
+	fi
+	contains same "yes"
+}
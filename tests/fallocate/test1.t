@@ -0,0 +1,14 @@
+function pre()
+{
+	cp `which bash` src/bash
+}
+
+function post()
+{
+	fallocate -l 20M mnt/bash
+	matches mnt/.original/bash `which bash`
+	fallocate -p -o 8192 -l 16384 mnt/bash
+	matches mnt/.original/bash `which bash`
+	fallocate -z -o 100000 -l 5000 mnt/bash
+	matches mnt/.original/bash `which bash`
+}
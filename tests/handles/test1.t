@@ -0,0 +1,17 @@
+function pre()
+{
+	truncate -s 64K src/sparse
+	dd if=/dev/urandom of=src/sparse bs=4096 seek=2 count=1 conv=notrunc 2> /dev/null
+	cp src/sparse sparse.orig
+}
+
+function post()
+{
+	# one handle punches out a block inside the hole that another then
+	# overwrites the whole of
+	exec 4<> mnt/sparse
+	fallocate -p -o 8192 -l 4096 mnt/sparse
+	dd if=/dev/urandom bs=4096 count=4 conv=notrunc 2> /dev/null >&4
+	exec 4>&-
+	matches mnt/.original/sparse sparse.orig
+}
@@ -0,0 +1,31 @@
+function writes()
+{
+	n=$(grep -A1 "^fuse write$" mnt/.cow/stats | tail -1 | awk '{ print $1 }')
+	echo ${n:-0}
+}
+
+function pre()
+{
+	cp `which bash` src/bash
+	echo "hello" > src/testfile
+}
+
+function post()
+{
+	# clones don't reach cow_fuse, so they're refused
+	cp --reflink=always mnt/bash mnt/clone 2> /dev/null && echo cloned > how || echo refused > how
+	contains how refused
+	
+	# and copies are made by writing through it
+	before=$(writes)
+	cp --reflink=auto mnt/bash mnt/bash2
+	after=$(writes)
+	(( after > before )) && echo yes > written || echo no > written
+	contains written yes
+	matches mnt/bash2 `which bash`
+	nofile mnt/.original/bash2
+	
+	cp --reflink=auto mnt/bash mnt/testfile
+	matches mnt/testfile `which bash`
+	contains mnt/.original/testfile "hello"
+}
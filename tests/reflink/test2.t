@@ -0,0 +1,33 @@
+function pre()
+{
+	# on a filesystem that can clone, so the history is kept by cloning
+	truncate -s 512M xfs.img
+	if mkfs.xfs -q xfs.img 2> /dev/null && mount -o loop xfs.img src 2> /dev/null
+	then
+		mounted_xfs=true
+	else
+		echo "can't mount XFS, so this doesn't test cloning"
+		mounted_xfs=false
+	fi
+	head -c 1M /dev/urandom > src/file
+	cp src/file file.orig
+}
+
+function post()
+{
+	# one handle is opened before another overwrites a block, and then
+	# overwrites it too, not knowing it's been preserved
+	exec 4<> mnt/file
+	dd if=/dev/urandom of=mnt/file bs=4096 count=1 conv=notrunc 2> /dev/null
+	dd if=/dev/urandom bs=4096 count=2 conv=notrunc 2> /dev/null >&4
+	exec 4>&-
+	matches mnt/.original/file file.orig
+}
+
+function after()
+{
+	if $mounted_xfs
+	then
+		umount src
+	fi
+}
@@ -0,0 +1,26 @@
+function pre()
+{
+	mkdir -p src/dir/sub
+	echo "hello" > src/dir/sub/testfile
+	echo "other" > src/dir/otherfile
+}
+
+function post()
+{
+	echo "goodbye" > mnt/dir/sub/testfile
+	mv mnt/dir mnt/dir2
+	nofile mnt/dir mnt/.original/dir2
+	contains mnt/dir2/sub/testfile "goodbye"
+	contains mnt/.original/dir/sub/testfile "hello"
+	contains mnt/.original/dir/otherfile "other"
+	
+	mv mnt/dir2/sub mnt/dir2/sub2
+	rm mnt/dir2/otherfile
+	contains mnt/.original/dir/sub/testfile "hello"
+	contains mnt/.original/dir/otherfile "other"
+	
+	mv mnt/dir2 mnt/dir
+	contains mnt/dir/sub2/testfile "goodbye"
+	contains mnt/.original/dir/sub/testfile "hello"
+	nofile mnt/.original/dir/sub2
+}
@@ -0,0 +1,26 @@
+function pre()
+{
+	mkdir -p src/dir/sub
+	echo "hello" > src/dir/sub/testfile
+	echo "other" > src/dir/otherfile
+	seq 1 10000 > src/numbers
+}
+
+function post()
+{
+	echo "goodbye" > mnt/dir/sub/testfile
+	mv mnt/dir mnt/dir2
+	rm mnt/dir2/otherfile
+	echo "new" > mnt/dir2/newfile
+	truncate -s 10 mnt/numbers
+}
+
+function after()
+{
+	../../cow_revert src > /dev/null
+	contains src/dir/sub/testfile "hello"
+	contains src/dir/otherfile "other"
+	nofile src/dir2 src/dir/newfile
+	seq 1 10000 > numbers
+	matches src/numbers numbers
+}
@@ -0,0 +1,23 @@
+function pre()
+{
+	mkdir -p src/dir
+	echo "one" > src/dir/file
+	echo "two" > src/other
+}
+
+function post()
+{
+	mkdir mnt/.snapshots/first
+	echo "changed" > mnt/dir/file
+	rm mnt/other
+	contains mnt/.snapshots/first/dir/file "one"
+	contains mnt/.snapshots/first/other "two"
+	
+	mkdir mnt/.snapshots/second
+	mv mnt/dir mnt/moved
+	echo "three" > mnt/other
+	contains mnt/.snapshots/first/dir/file "one"
+	contains mnt/.snapshots/second/dir/file "changed"
+	nofile mnt/.snapshots/second/other mnt/.snapshots/second/moved
+	contains mnt/.original/dir/file "one"
+}
@@ -0,0 +1,16 @@
+function pre()
+{
+	truncate -s 10M src/sparse
+	echo "hello" | dd of=src/sparse bs=1 seek=5000000 conv=notrunc 2> /dev/null
+	cp src/sparse sparse.orig
+}
+
+function post()
+{
+	dd if=/dev/urandom of=mnt/sparse bs=4096 seek=10 count=4 conv=notrunc 2> /dev/null
+	matches mnt/.original/sparse sparse.orig
+	dd if=/dev/urandom of=mnt/sparse bs=4096 seek=1220 count=4 conv=notrunc 2> /dev/null
+	matches mnt/.original/sparse sparse.orig
+	truncate -s 1M mnt/sparse
+	matches mnt/.original/sparse sparse.orig
+}
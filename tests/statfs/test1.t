@@ -0,0 +1,25 @@
+COW_OPTIONS="--history-budget=100"
+
+function pre()
+{
+	echo "hello" > src/file
+}
+
+function post()
+{
+	read size blocks avail < <(stat -f -c "%S %b %a" src)
+	read msize mblocks mavail < <(stat -f -c "%S %b %a" mnt)
+	echo $msize > size
+	contains size $size
+	
+	# the history takes something, but not a lot
+	history=$(( (blocks-mblocks)*size ))
+	(( history > 0 && history < 10*1048576 )) && echo yes > history || echo no > history
+	contains history yes
+	
+	# and what's left of its 100MB is kept for it, give or take what
+	# changed on the backing filesystem meanwhile
+	kept=$(( (avail-mavail)*size/1048576 ))
+	(( kept >= 90 && kept <= 100 )) && echo yes > kept || echo no > kept
+	contains kept yes
+}
@@ -0,0 +1,19 @@
+function calls()
+{
+	grep -A1 "^fuse $1\$" mnt/.cow/stats | tail -1 | awk '{ print $1 }'
+}
+
+function pre()
+{
+	echo "hello" > src/file
+}
+
+function post()
+{
+	echo "one" >> mnt/file
+	before=$(calls write)
+	echo "two" >> mnt/file
+	after=$(calls write)
+	(( after > before )) && echo yes > more || echo no > more
+	contains more yes
+}
@@ -0,0 +1,12 @@
+function pre()
+{
+	mkdir -p src/a/b
+	echo "hello" > src/a/b/testfile
+}
+
+function post()
+{
+	echo "goodbye" > mnt/a/b/testfile
+	contains mnt/a/b/testfile "goodbye"
+	contains mnt/.original/a/b/testfile "hello"
+}
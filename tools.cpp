@@ -0,0 +1,68 @@
+#include "tools.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+extern void register_openat_vfs();
+
+bool open_history(const std::string &origin_path, Sql &db, Nodes &nodes)
+{
+	origin_fd = ::open(origin_path.c_str(), O_DIRECTORY);
+	if (origin_fd == -1 || ::faccessat(origin_fd, ".cow/history.db", F_OK, 0) == -1)
+	{
+		std::cerr << "No history in " << origin_path
+			<< "; mount and unmount it with cow_fuse first" << std::endl;
+		return false;
+	}
+	register_openat_vfs();
+	db.open(".cow/history.db");
+	nodes.open();
+	
+	struct stat journal;
+	if (::fstatat(origin_fd, ".cow/capture.journal", &journal, 0) == 0 && journal.st_size > 0)
+	{
+		std::cerr << "Some of the history is still in .cow/capture.journal; "
+			"mount and unmount " << origin_path << " first" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+const char *atdir(const char *path)
+{
+	path++;
+	if (*path == '\0')
+		path = ".";
+	return path;
+}
+
+size_t depth(const std::string &path)
+{
+	return std::count(path.begin(), path.end(), '/');
+}
+
+uint64_t stat_field(const std::vector<unsigned char> &st, unsigned field)
+{
+	uint64_t val=0;
+	for (unsigned i=0; i < 8; i++)
+		val = (val << 8) | st[8*field + i];
+	return val;
+}
+
+bool write_all(int fd, const char *data, size_t length, off_t offset)
+{
+	while (length > 0)
+	{
+		const ssize_t w = pwrite(fd, data, length, offset);
+		if (w <= 0)
+			return false;
+		data += w;
+		length -= w;
+		offset += w;
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+#ifndef TOOLS_H
+#define TOOLS_H
+
+#include "sql.h"
+#include "nodes.h"
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// What the tools that work on a tree that isn't mounted (cow_revert,
+// cow_diff) share. They read its history directly, with paths relative to
+// origin_fd, which each of them defines.
+extern int origin_fd;
+
+// open 'origin_path', and its history in 'db'; false, having said why, if
+// it has none or some of it hasn't been put into it yet
+bool open_history(const std::string &origin_path, Sql &db, Nodes &nodes);
+
+// 'path' (from the top of the tree, so starting with a /) for the *at()
+// functions, with origin_fd
+const char *atdir(const char *path);
+size_t depth(const std::string &path);
+
+// a field of a stat as cow_fuse serializes them
+enum { stat_mode=0, stat_size=5, stat_atime=7, stat_mtime=8 };
+uint64_t stat_field(const std::vector<unsigned char> &st, unsigned field);
+
+bool write_all(int fd, const char *data, size_t length, off_t offset);
+
+#endif